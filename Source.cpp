@@ -1,7 +1,54 @@
 #include<thread>
+#include<stop_token>
 #include<utility>
+#include<functional>
 #include<stdexcept>
 #include<vector>
+#include<numeric>
+#include<iterator>
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<memory>
+#include<tuple>
+#include<type_traits>
+#include<future>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<cstdint>
+#include<cstddef>
+#include<new>
+#include<cstring>
+#include<cerrno>
+#include<memory_resource>
+#include<optional>
+#include<variant>
+#include<exception>
+#include<string>
+#include<sstream>
+#include<fstream>
+#include<coroutine>
+#include<semaphore>
+#include<random>
+#include<latch>
+#ifdef __linux__
+#include<pthread.h>
+#include<sched.h>
+#include<unistd.h>
+#include<sys/syscall.h>
+#include<linux/mempolicy.h>
+#include<sys/mman.h>
+#include<time.h>
+#endif
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include<immintrin.h>
+#elif defined(__ARM_NEON)
+#include<arm_neon.h>
+#endif
+#ifdef _MSC_VER
+#include<intrin.h>
+#endif
 
 /****************************/
 /* 2.1.1 Launching a thread */
@@ -70,6 +117,197 @@ void oops()
 /* 2.1.3 Waiting in exceptional circumstances */
 /**********************************************/
 
+// Thread lifetime tracing, compiled out unless built with -DTHREAD_TRACING=1. The wrappers below record how long
+// their callers block in join() (most joins in destructors), joining_thread also records spawn, start latency and
+// run time. write_chrome_trace() exports everything as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+#ifndef THREAD_TRACING
+#define THREAD_TRACING 0
+#endif
+#if THREAD_TRACING
+class thread_trace
+{
+public:
+    using clock = std::chrono::steady_clock;
+private:
+    struct slice
+    {
+        char const* name; // "start", "run" or "join"
+        char const* wrapper;
+        std::uint64_t track; // Thread the slice is drawn on
+        std::uint64_t joined; // For "join": the thread waited for, 0 if it wasn't traced
+        clock::time_point begin;
+        clock::time_point end;
+    };
+    struct traced_thread // Started by traced_body and not joined by traced_join yet
+    {
+        std::thread::id id;
+        std::uint64_t track;
+        bool finished;
+    };
+    std::mutex m;
+    std::vector<slice> slices;
+    std::vector<std::pair<std::uint64_t, std::string>> names;
+    std::vector<traced_thread> unjoined;
+    std::atomic<std::uint64_t> next_track{ 0 };
+    static inline clock::time_point const origin = clock::now(); // Static initialisation, before main() spawns anything
+
+    static void write_string(std::ostream& out, std::string const& str)
+    {
+        out << '"';
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out << '\\';
+            }
+            out << (static_cast<unsigned char>(c) < 0x20 ? ' ' : c);
+        }
+        out << '"';
+    }
+public:
+    static thread_trace& instance()
+    {
+        static thread_trace trace;
+        return trace;
+    }
+    // Tracks are numbered in the order threads first use the trace. std::thread::id values are reused once a thread
+    // has exited, which a shrinking pool makes routine: keyed by id, a retired worker's track would go to its successor
+    std::uint64_t track_of_this_thread() noexcept
+    {
+        thread_local std::uint64_t const track = next_track.fetch_add(1, std::memory_order_relaxed) + 1;
+        return track;
+    }
+    void add(char const* name, char const* wrapper, std::uint64_t joined, clock::time_point begin, clock::time_point end)
+    {
+        std::uint64_t const track = track_of_this_thread();
+        std::lock_guard<std::mutex> lk(m);
+        slices.push_back({ name, wrapper, track, joined, begin, end });
+    }
+    void name_current_thread(std::string name)
+    {
+        std::uint64_t const track = track_of_this_thread();
+        std::lock_guard<std::mutex> lk(m);
+        names.emplace_back(track, std::move(name));
+    }
+    // A finished thread with the same id was joined already, without traced_join (native_thread)
+    void thread_started()
+    {
+        std::uint64_t const track = track_of_this_thread();
+        std::lock_guard<std::mutex> lk(m);
+        std::thread::id const id = std::this_thread::get_id();
+        std::erase_if(unjoined, [id](traced_thread const& t) { return t.id == id && t.finished; });
+        unjoined.push_back({ id, track, false });
+    }
+    void thread_finished()
+    {
+        std::uint64_t const track = track_of_this_thread();
+        std::lock_guard<std::mutex> lk(m);
+        for (auto& t : unjoined)
+        {
+            if (t.track == track)
+            {
+                t.finished = true;
+            }
+        }
+    }
+    // Track of the thread that had id and has just been joined. A thread reusing id already can't have finished
+    std::uint64_t joined_track(std::thread::id id)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto const it = std::find_if(unjoined.begin(), unjoined.end(), [id](traced_thread const& t) { return t.id == id && t.finished; });
+        if (it == unjoined.end())
+        {
+            return 0;
+        }
+        std::uint64_t const track = it->track;
+        unjoined.erase(it);
+        return track;
+    }
+    // One process, one track per thread. Times are microseconds since the program started, or since the first
+    // slice if a thread was already spawned during static initialisation: no timestamp is negative
+    void write_chrome_trace(std::ostream& out)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        clock::time_point base = origin;
+        for (auto const& sl : slices)
+        {
+            base = std::min(base, sl.begin);
+        }
+        auto const us = [base](clock::time_point t) { return std::chrono::duration<double, std::micro>(t - base).count(); };
+        char const* separator = "";
+        out << "{\"traceEvents\":[";
+        for (auto const& [track, name] : names)
+        {
+            out << separator << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track << ",\"args\":{\"name\":";
+            write_string(out, name);
+            out << "}}";
+            separator = ",";
+        }
+        for (auto const& sl : slices)
+        {
+            out << separator << "\n{\"name\":\"" << sl.name << "\",\"cat\":\"" << sl.wrapper << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << sl.track
+                << ",\"ts\":" << us(sl.begin) << ",\"dur\":" << us(sl.end) - us(sl.begin);
+            if (sl.joined != 0)
+            {
+                out << ",\"args\":{\"joined_tid\":" << sl.joined << "}";
+            }
+            out << "}";
+            separator = ",";
+        }
+        out << "\n]}\n";
+    }
+};
+// Wraps a thread body so the new thread records its start latency (from spawn) and its run time
+template<typename Callable>
+auto traced_body(char const* wrapper, Callable&& func)
+{
+    return [wrapper, spawned = thread_trace::clock::now(), func = std::decay_t<Callable>(std::forward<Callable>(func))](auto&& ... args) mutable
+    {
+        auto& trace = thread_trace::instance();
+        auto const started = thread_trace::clock::now();
+        trace.thread_started();
+        trace.add("start", wrapper, 0, spawned, started);
+        struct finish // Also records a body that ends with an exception (std::terminate can still run it)
+        {
+            thread_trace& trace;
+            char const* wrapper;
+            thread_trace::clock::time_point started;
+            ~finish()
+            {
+                trace.add("run", wrapper, 0, started, thread_trace::clock::now());
+                trace.thread_finished();
+            }
+        } const f{ trace, wrapper, started };
+        return std::invoke(std::move(func), std::forward<decltype(args)>(args)...);
+    };
+}
+// Joins t and records how long the caller was blocked
+void traced_join(std::thread& t, char const* wrapper)
+{
+    std::thread::id const id = t.get_id();
+    auto const begin = thread_trace::clock::now();
+    t.join();
+    auto const end = thread_trace::clock::now();
+    auto& trace = thread_trace::instance();
+    trace.add("join", wrapper, trace.joined_track(id), begin, end);
+}
+void name_current_thread(std::string name) // Shown as the track name of the calling thread
+{
+    thread_trace::instance().name_current_thread(std::move(name));
+}
+#else
+template<typename Callable>
+Callable&& traced_body(char const*, Callable&& func)
+{
+    return std::forward<Callable>(func);
+}
+void traced_join(std::thread& t, char const*)
+{
+    t.join();
+}
+void name_current_thread(std::string const&) {}
+#endif
+
 // Using join in catch block is verbose. It's better to use RAII concept
 // Resource Aqcuisition Is Initialization
 class thread_guard
@@ -81,7 +319,7 @@ public:
     {
         if (t.joinable())
         {
-            t.join();
+            traced_join(t, "thread_guard");
         }
     }
     thread_guard(const thread_guard&) = delete;
@@ -106,9 +344,11 @@ void f()
 /******************************************/
 
 // Detached threads are often called daemon threads
+// Nothing limits the number of detached threads, so background work is handed to a bounded executor instead
+class background_executor; // See 9.1.6
+background_executor& document_executor(); // Shared by the whole application, drains its queue at exit
 void do_background_work();
-std::thread t(do_background_work);
-t.detach();
+document_executor().submit(do_background_work); // Instead of std::thread t(do_background_work); t.detach();
 
 // Detaching a thread to handle other documents in a text editor
 void edit_document(std::string const& filename)
@@ -120,8 +360,10 @@ void edit_document(std::string const& filename)
         if (cmd.type == open_new_document)
         {
             std::string const new_name = get_filename_from_user();
-            std::thread t(edit_document, new_name);
-            t.detach();
+            if (!document_executor().submit(edit_document, new_name)) // Runs on one of a limited number of threads
+            {
+                display_too_many_documents(); // Executor is full (overflow_policy::reject)
+            }
         }
         else
         {
@@ -234,6 +476,223 @@ void g()
     f(std::move(t));
 }
 
+// Where a thread runs. The OS may migrate a thread to another core at any time. The thread loses its cache,
+// and on a multi-socket machine its memory may end up on the other NUMA node (remote accesses, less bandwidth)
+enum class memory_placement
+{
+    os_default, // Keep the policy of the process
+    first_touch, // A page comes from the node of the CPU that touches it first (MPOL_LOCAL)
+    bind, // Pages come only from numa_node (MPOL_BIND)
+    interleave // Pages are spread round-robin over all nodes (MPOL_INTERLEAVE)
+};
+// Stacks default to ulimit -s (8 MB on most Linux systems) of reserved address space, only touched pages use memory.
+// stack_size and guard_size are only applied by native_thread, which the pool and background_executor workers use:
+// std::thread takes no attributes, so joining_thread and make_thread keep the process default
+struct thread_attributes
+{
+    std::vector<unsigned> cpus; // Logical CPUs the thread may run on. Empty: the CPUs of numa_node, or any CPU
+    int numa_node = -1; // -1: no preference
+    memory_placement memory = memory_placement::os_default;
+    std::size_t stack_size = 0; // Bytes, rounded up to whole pages and to the platform minimum. 0: the default
+    std::optional<std::size_t> guard_size; // Bytes of inaccessible pages below the stack. Empty: the default (a page)
+    bool huge_page_stack = false; // Transparent huge pages for the stack: fewer TLB misses, but memory is committed 2 MB at a time
+};
+// What apply_thread_attributes() did for the calling thread. A field is false if it wasn't asked for,
+// or if the OS refused it (unknown CPU, no NUMA, transparent huge pages disabled, another platform)
+struct applied_thread_attributes
+{
+    bool cpus = false;
+    bool memory = false;
+    bool stack_size = false;
+    bool guard_size = false;
+    bool huge_page_stack = false;
+};
+inline thread_local applied_thread_attributes current_applied_attributes;
+// Queried on the thread itself, e.g. at the start of its function or in a pool task
+applied_thread_attributes applied_attributes_of_this_thread() noexcept
+{
+    return current_applied_attributes;
+}
+
+// The topology behind hardware_concurrency() is read from sysfs on Linux
+// "0-3,8,10-11" -> 0 1 2 3 8 10 11
+std::vector<unsigned> parse_cpu_list(std::string const& list)
+{
+    std::vector<unsigned> result;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        unsigned first = 0, last = 0;
+        int const n = std::sscanf(range.c_str(), "%u-%u", &first, &last);
+        if (n < 1)
+        {
+            continue;
+        }
+        for (unsigned cpu = first; cpu <= (n == 2 ? last : first); cpu++)
+        {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+std::vector<unsigned> read_cpu_list(std::string const& path)
+{
+    std::ifstream file(path);
+    std::string list;
+    std::getline(file, list);
+    return parse_cpu_list(list); // Empty if the file doesn't exist
+}
+// CPUs this process may run on (taskset and cgroups included)
+std::vector<unsigned> allowed_cpus()
+{
+    std::vector<unsigned> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty())
+    {
+        for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+// One logical CPU per physical core: hyper-threads of the same core share its caches and execution units
+std::vector<unsigned> physical_core_cpus()
+{
+    std::vector<unsigned> cores;
+    for (unsigned cpu : allowed_cpus())
+    {
+        auto const siblings = read_cpu_list("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+        bool const first_allowed_sibling = std::none_of(siblings.begin(), siblings.end(), [&](unsigned sibling)
+        {
+            return sibling != cpu && std::find(cores.begin(), cores.end(), sibling) != cores.end();
+        });
+        if (first_allowed_sibling)
+        {
+            cores.push_back(cpu);
+        }
+    }
+    return cores;
+}
+std::vector<unsigned> numa_node_cpus(int node)
+{
+    return read_cpu_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+int numa_node_of_cpu(unsigned cpu)
+{
+    for (unsigned node : read_cpu_list("/sys/devices/system/node/online"))
+    {
+        auto const cpus = numa_node_cpus(static_cast<int>(node));
+        if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+        {
+            return static_cast<int>(node);
+        }
+    }
+    return -1;
+}
+
+// Called by the new thread itself, before it runs anything: the memory policy can only be set for the calling thread,
+// and the thread stack and first allocations are already touched on the right node.
+// Placement is a hint, a CPU or node that doesn't exist is ignored and other platforms ignore it altogether.
+// What was applied is returned, and kept for applied_attributes_of_this_thread()
+applied_thread_attributes apply_thread_attributes(thread_attributes const& attrs)
+{
+    applied_thread_attributes applied;
+#ifdef __linux__
+    std::vector<unsigned> cpus = attrs.cpus;
+    if (cpus.empty() && attrs.numa_node >= 0)
+    {
+        cpus = numa_node_cpus(attrs.numa_node);
+    }
+    if (!cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu : cpus)
+        {
+            if (cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        applied.cpus = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#ifdef MADV_HUGEPAGE
+    pthread_attr_t self;
+    if (attrs.huge_page_stack && pthread_getattr_np(pthread_self(), &self) == 0)
+    {
+        void* stack = nullptr;
+        std::size_t size = 0;
+        if (pthread_attr_getstack(&self, &stack, &size) == 0)
+        {
+            applied.huge_page_stack = madvise(stack, size, MADV_HUGEPAGE) == 0; // Only the aligned 2 MB blocks inside the stack can use huge pages
+        }
+        pthread_attr_destroy(&self);
+    }
+#endif
+    int const node = attrs.numa_node >= 0 ? attrs.numa_node : (cpus.empty() ? -1 : numa_node_of_cpu(cpus.front()));
+    unsigned long nodes[16] = {}; // Node mask for set_mempolicy, up to 1024 nodes
+    auto const add_node = [&nodes](unsigned n)
+    {
+        if (n < sizeof(nodes) * 8)
+        {
+            nodes[n / (sizeof(unsigned long) * 8)] |= 1ul << (n % (sizeof(unsigned long) * 8));
+        }
+    };
+    switch (attrs.memory)
+    {
+    case memory_placement::os_default:
+        break;
+    case memory_placement::first_touch:
+        applied.memory = syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) == 0;
+        break;
+    case memory_placement::bind:
+        if (node >= 0)
+        {
+            add_node(static_cast<unsigned>(node));
+            applied.memory = syscall(SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8) == 0;
+        }
+        break;
+    case memory_placement::interleave:
+        for (unsigned n : read_cpu_list("/sys/devices/system/node/online"))
+        {
+            add_node(n);
+        }
+        applied.memory = syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, nodes, sizeof(nodes) * 8) == 0;
+        break;
+    }
+#else
+    (void)attrs;
+#endif
+    current_applied_attributes = applied;
+    return applied;
+}
+
+// Launches a std::thread which applies attrs before calling func(args...). Arguments are passed as by std::thread
+// Usable for scoped_thread: scoped_thread t{ make_thread(attrs, func(some_local_state)) };
+template<typename Callable, typename ... Args>
+std::thread make_thread(thread_attributes attrs, Callable&& func, Args&& ... args)
+{
+    return std::thread([attrs = std::move(attrs)](auto&& f, auto&& ... a)
+        {
+            apply_thread_attributes(attrs);
+            std::invoke(std::move(f), std::move(a)...);
+        }, std::forward<Callable>(func), std::forward<Args>(args)...);
+}
+
 // Move allows to build a thread_guard class and have it take ownership of the thread
 // Now thread_guard can't outlive the thread it was referencing
 // No one else can join or detach thread
@@ -252,7 +711,7 @@ public:
     }
     ~scoped_thread()
     {
-        t.join();
+        traced_join(t, "scoped_thread");
     }
     scoped_thread(const scoped_thread&) = delete;
     scoped_thread& operator=(const scoped_thread&) = delete;
@@ -268,25 +727,54 @@ void f()
 // Listing 2.7 A joining_thread class
 class joining_thread
 {
+    std::stop_source stop_src{ std::nostopstate }; // Has a stop state only if the callable takes a std::stop_token
     std::thread t;
+
+    // Like std::jthread: if func can be called with a std::stop_token as its first argument, it gets one
+    template<typename Factory, typename Callable, typename ... Args>
+    static std::thread launch(std::stop_source& ss, Factory factory, Callable&& func, Args&& ... args)
+    {
+        if constexpr (std::is_invocable_v<std::decay_t<Callable>, std::stop_token, std::decay_t<Args>...>)
+        {
+            ss = std::stop_source();
+            return factory(traced_body("joining_thread", std::forward<Callable>(func)), ss.get_token(), std::forward<Args>(args)...);
+        }
+        else
+        {
+            return factory(traced_body("joining_thread", std::forward<Callable>(func)), std::forward<Args>(args)...);
+        }
+    }
+    void stop_and_join()
+    {
+        request_stop(); // A thread polling its token finishes early, the others run to completion
+        join();
+    }
 public:
     joining_thread() noexcept = default; // default constructor
-    template<typename Callable, typename ... Args>
+    template<typename Callable, typename ... Args,
+        typename = std::enable_if_t<!std::is_same_v<std::decay_t<Callable>, thread_attributes>>>
     explicit joining_thread(Callable&& func, Args&& ... args) : // thread-like constructor accepting callable and args
-        t(std::forward<Callable>(func), std::forward<Args>(args)...)
+        t(launch(stop_src, [](auto&& ... a) { return std::thread(std::forward<decltype(a)>(a)...); },
+            std::forward<Callable>(func), std::forward<Args>(args)...))
+    {}
+    template<typename Callable, typename ... Args>
+    explicit joining_thread(thread_attributes const& attrs, Callable&& func, Args&& ... args) : // Same, with CPU/NUMA placement
+        t(launch(stop_src, [&attrs](auto&& ... a) { return make_thread(attrs, std::forward<decltype(a)>(a)...); },
+            std::forward<Callable>(func), std::forward<Args>(args)...))
     {}
     explicit joining_thread(std::thread t_) noexcept: // Constructor accepting a thread
         t(std::move(t_))
     {}
     joining_thread(joining_thread&& other) noexcept: // Move constructor
-        t(std::move(other.t))
+        stop_src(std::move(other.stop_src)), t(std::move(other.t))
     {}
     joining_thread& operator=(joining_thread&& other) noexcept // Move assignment
     {
         if (joinable())
         {
-            join();
+            stop_and_join(); // Bounded by how often the old thread checks its token, not by its whole workload
         }
+        stop_src = std::move(other.stop_src);
         t = std::move(other.t);
         return *this;
     }
@@ -294,8 +782,9 @@ public:
     {
         if (joinable())
         {
-            join();
+            stop_and_join();
         }
+        stop_src = std::stop_source(std::nostopstate);
         t = std::move(other);
         return *this;
     }
@@ -303,11 +792,12 @@ public:
     {
         if (joinable())
         {
-            join();
+            stop_and_join();
         }
     }
     void swap(joining_thread& other) noexcept
     {
+        stop_src.swap(other.stop_src);
         t.swap(other.t);
     }
     std::thread::id get_id() const noexcept
@@ -320,12 +810,24 @@ public:
     }
     void join()
     {
-        t.join();
+        traced_join(t, "joining_thread");
     }
     void detach()
     {
         t.detach();
     }
+    bool request_stop() noexcept // false if the thread has no token or stop was already requested
+    {
+        return stop_src.request_stop();
+    }
+    std::stop_source get_stop_source() const noexcept
+    {
+        return stop_src;
+    }
+    std::stop_token get_stop_token() const noexcept
+    {
+        return stop_src.get_token();
+    }
     std::thread& as_thread() noexcept
     {
         return t;
@@ -336,6 +838,168 @@ public:
     }
 };
 
+// func from 2.1.1 with cooperative cancellation. Destroying or reassigning its joining_thread stops the loop early
+struct stoppable_func
+{
+    int& i;
+    stoppable_func(int& i_) : i(i_) {}
+    void operator() (std::stop_token stop)
+    {
+        for (unsigned j = 0; j < 1000000 && !stop.stop_requested(); j++)
+        {
+            do_something(i);
+        }
+    }
+};
+void stoppable_f()
+{
+    int some_local_state = 0;
+    joining_thread t(stoppable_func{ some_local_state }); // Gets a std::stop_token from t
+    do_something_in_current_thread();
+} // Stop is requested, the loop ends after the current iteration and t is joined
+
+// Joined on destruction and assignment like joining_thread (without a stop token), but started with pthread_create,
+// so it gets the stack_size and guard_size of its attributes. If the platform refuses them (EINVAL) the thread
+// starts with the default stack, and applied_attributes_of_this_thread() says so. Elsewhere it's a std::thread
+class native_thread
+{
+#ifdef __linux__
+    pthread_t handle{};
+    bool started = false;
+
+    template<typename Callable, typename ... Args>
+    struct start_data
+    {
+        thread_attributes attrs;
+        Callable func;
+        std::tuple<Args...> args;
+        bool stack_size = false; // Set before the thread starts
+        bool guard_size = false;
+    };
+    template<typename Data>
+    static void* run(void* p) noexcept // An exception leaving func ends the program, as in std::thread
+    {
+        std::unique_ptr<Data> const data(static_cast<Data*>(p));
+        apply_thread_attributes(data->attrs);
+        current_applied_attributes.stack_size = data->stack_size;
+        current_applied_attributes.guard_size = data->guard_size;
+        std::apply(std::move(data->func), std::move(data->args));
+        return nullptr;
+    }
+    template<typename Callable, typename ... Args>
+    void start(thread_attributes const& attrs, Callable&& func, Args&& ... args)
+    {
+        using data_type = start_data<std::decay_t<Callable>, std::decay_t<Args>...>;
+        std::unique_ptr<data_type> data(new data_type{ attrs, std::forward<Callable>(func),
+            std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...) });
+        pthread_attr_t attr;
+        int error = pthread_attr_init(&attr);
+        if (error == 0)
+        {
+            if (attrs.stack_size != 0)
+            {
+                std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+                std::size_t const size = std::max(attrs.stack_size, static_cast<std::size_t>(sysconf(_SC_THREAD_STACK_MIN)));
+                data->stack_size = pthread_attr_setstacksize(&attr, (size + page - 1) / page * page) == 0;
+            }
+            if (attrs.guard_size)
+            {
+                data->guard_size = pthread_attr_setguardsize(&attr, *attrs.guard_size) == 0;
+            }
+            error = pthread_create(&handle, &attr, &run<data_type>, data.get());
+            pthread_attr_destroy(&attr);
+        }
+        if (error == EINVAL && (data->stack_size || data->guard_size)) // E.g. a stack too small for a sanitizer runtime
+        {
+            data->stack_size = false;
+            data->guard_size = false;
+            error = pthread_create(&handle, nullptr, &run<data_type>, data.get());
+        }
+        if (error != 0)
+        {
+            throw std::system_error(error, std::system_category(), "pthread_create");
+        }
+        data.release(); // Deleted by the thread
+        started = true;
+    }
+#else
+    std::thread t;
+#endif
+public:
+    native_thread() noexcept = default;
+    template<typename Callable, typename ... Args>
+    explicit native_thread(thread_attributes const& attrs, Callable&& func, Args&& ... args)
+    {
+#ifdef __linux__
+        start(attrs, traced_body("native_thread", std::forward<Callable>(func)), std::forward<Args>(args)...);
+#else
+        t = make_thread(attrs, traced_body("native_thread", std::forward<Callable>(func)), std::forward<Args>(args)...);
+#endif
+    }
+    native_thread(native_thread&& other) noexcept
+    {
+        swap(other);
+    }
+    native_thread& operator=(native_thread&& other) noexcept
+    {
+        if (joinable())
+        {
+            join();
+        }
+        swap(other);
+        return *this;
+    }
+    ~native_thread()
+    {
+        if (joinable())
+        {
+            join();
+        }
+    }
+    void swap(native_thread& other) noexcept
+    {
+#ifdef __linux__
+        std::swap(handle, other.handle);
+        std::swap(started, other.started);
+#else
+        t.swap(other.t);
+#endif
+    }
+    bool joinable() const noexcept
+    {
+#ifdef __linux__
+        return started;
+#else
+        return t.joinable();
+#endif
+    }
+    void join()
+    {
+#ifdef __linux__
+        if (!started)
+        {
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), "native_thread::join");
+        }
+        int const error = pthread_join(handle, nullptr);
+        if (error != 0)
+        {
+            throw std::system_error(error, std::system_category(), "pthread_join");
+        }
+        started = false;
+#else
+        t.join();
+#endif
+    }
+    std::thread::native_handle_type native_handle() noexcept
+    {
+#ifdef __linux__
+        return handle;
+#else
+        return t.native_handle();
+#endif
+    }
+};
+
 // Move semantics allows to make a vector of threads
 // Listing 2.8 Spawns some threads and waits for them to finish
 void do_work(unsigned id);
@@ -345,11 +1009,104 @@ void f()
     for (unsigned i = 0; i < 20; i++)
     {
         threads.emplace_back(do_work, i);
+    }
+    for (auto& entry : threads) // Join only after all threads are spawned, otherwise do_work calls run one by one
+    {
+        entry.join();
+    }
+}
+
+// thread_group owns a set of joining_threads. Fan-out with spawn(), fan-in with join_all()
+// Threads that are still running are joined in the destructor
+class thread_group
+{
+    std::vector<joining_thread> threads;
+public:
+    thread_group() = default;
+    explicit thread_group(std::size_t expected_size)
+    {
+        threads.reserve(expected_size); // Avoid reallocations while spawning
+    }
+    thread_group(thread_group&&) = default;
+    thread_group& operator=(thread_group&& other) noexcept
+    {
+        join_all();
+        threads = std::move(other.threads);
+        return *this;
+    }
+    thread_group(const thread_group&) = delete;
+    thread_group& operator=(const thread_group&) = delete;
+    ~thread_group()
+    {
+        request_stop(); // All threads get the request first, so they stop in parallel
+        join_all();
+    }
+    template<typename Callable, typename ... Args>
+    joining_thread& spawn(Callable&& func, Args&& ... args) // Same arguments as the std::thread constructor
+    {
+        threads.emplace_back(std::forward<Callable>(func), std::forward<Args>(args)...);
+        return threads.back();
+    }
+    void join_all() noexcept
+    {
+        for (auto& entry : threads)
+        {
+            if (entry.joinable()) // Threads already joined through the spawn() reference are skipped
+            {
+                entry.join();
+            }
+        }
+        threads.clear();
+    }
+    void request_stop() noexcept // For threads started with a callable taking a std::stop_token
+    {
         for (auto& entry : threads)
         {
-            entry.join();
+            entry.request_stop();
+        }
+    }
+    std::size_t size() const noexcept
+    {
+        return threads.size();
+    }
+};
+void g()
+{
+    thread_group group(20);
+    for (unsigned i = 0; i < 20; i++)
+    {
+        group.spawn(do_work, i);
+    }
+    group.join_all(); // Or leave it to the destructor
+}
+
+// Wall-clock difference between joining inside the spawn loop (serialized) and after it (parallel)
+// Every task sleeps, so the difference shows up even on a single core
+std::chrono::microseconds time_spawn_join(unsigned num_tasks, bool join_inside_loop)
+{
+    auto const task = [] { std::this_thread::sleep_for(std::chrono::milliseconds(1)); };
+    auto const start = std::chrono::steady_clock::now();
+    {
+        thread_group group(num_tasks);
+        for (unsigned i = 0; i < num_tasks; i++)
+        {
+            group.spawn(task);
+            if (join_inside_loop)
+            {
+                group.join_all(); // What the original Listing 2.8 loop did (minus joining the joined threads)
+            }
         }
     }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+void benchmark_spawn_join()
+{
+    for (unsigned num_tasks : { 1u, 4u, 20u, 100u })
+    {
+        std::printf("tasks=%u join_inside_loop_us=%lld join_after_loop_us=%lld\n", num_tasks,
+            static_cast<long long>(time_spawn_join(num_tasks, true).count()),
+            static_cast<long long>(time_spawn_join(num_tasks, false).count()));
+    }
 }
 
 
@@ -359,3 +1116,4432 @@ void f()
 /*************************************************/
 /* 2.4 Choosing the number of threads at runtime */
 /*************************************************/
+
+// std::thread::hardware_concurrency() returns the number of threads that can truly run concurrently
+// (number of cores or hardware threads). It's only a hint, it may return 0 if the information isn't available
+
+// Reduction kernels used by every thread of parallel_accumulate. std::accumulate adds one element after the other,
+// and for float and double the compiler must keep that order, so it's one dependent add per cycle at best.
+// Integer addition and multiplication are associative, so they can always be split over vector lanes.
+// Floating point only when the caller accepts a different rounding (relaxed_fp_order)
+struct strict_fp_order {}; // Floating point in sequence, the same result as std::accumulate
+struct relaxed_fp_order {}; // Floating point may be reassociated
+
+// Vector registers for the compiled-for instruction set. width == 0 means no intrinsics for T
+template<typename T>
+struct simd_lanes
+{
+    static constexpr std::size_t width = 0;
+};
+#if defined(__AVX512F__)
+template<>
+struct simd_lanes<float>
+{
+    using reg = __m512;
+    static constexpr std::size_t width = 16;
+    static reg set1(float v) { return _mm512_set1_ps(v); }
+    static reg load(float const* p) { return _mm512_loadu_ps(p); }
+    static void store(float* p, reg r) { _mm512_storeu_ps(p, r); }
+    static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+};
+template<>
+struct simd_lanes<double>
+{
+    using reg = __m512d;
+    static constexpr std::size_t width = 8;
+    static reg set1(double v) { return _mm512_set1_pd(v); }
+    static reg load(double const* p) { return _mm512_loadu_pd(p); }
+    static void store(double* p, reg r) { _mm512_storeu_pd(p, r); }
+    static reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+};
+#elif defined(__AVX2__)
+template<>
+struct simd_lanes<float>
+{
+    using reg = __m256;
+    static constexpr std::size_t width = 8;
+    static reg set1(float v) { return _mm256_set1_ps(v); }
+    static reg load(float const* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, reg r) { _mm256_storeu_ps(p, r); }
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+};
+template<>
+struct simd_lanes<double>
+{
+    using reg = __m256d;
+    static constexpr std::size_t width = 4;
+    static reg set1(double v) { return _mm256_set1_pd(v); }
+    static reg load(double const* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, reg r) { _mm256_storeu_pd(p, r); }
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+};
+#elif defined(__ARM_NEON)
+template<>
+struct simd_lanes<float>
+{
+    using reg = float32x4_t;
+    static constexpr std::size_t width = 4;
+    static reg set1(float v) { return vdupq_n_f32(v); }
+    static reg load(float const* p) { return vld1q_f32(p); }
+    static void store(float* p, reg r) { vst1q_f32(p, r); }
+    static reg add(reg a, reg b) { return vaddq_f32(a, b); }
+    static reg mul(reg a, reg b) { return vmulq_f32(a, b); }
+};
+#if defined(__aarch64__) // 32-bit NEON has no double lanes
+template<>
+struct simd_lanes<double>
+{
+    using reg = float64x2_t;
+    static constexpr std::size_t width = 2;
+    static reg set1(double v) { return vdupq_n_f64(v); }
+    static reg load(double const* p) { return vld1q_f64(p); }
+    static void store(double* p, reg r) { vst1q_f64(p, r); }
+    static reg add(reg a, reg b) { return vaddq_f64(a, b); }
+    static reg mul(reg a, reg b) { return vmulq_f64(a, b); }
+};
+#endif
+#endif
+
+template<typename T, typename BinaryOp>
+constexpr bool is_plus_v = std::is_same_v<BinaryOp, std::plus<T>> || std::is_same_v<BinaryOp, std::plus<>>;
+template<typename T, typename BinaryOp>
+constexpr bool is_multiplies_v = std::is_same_v<BinaryOp, std::multiplies<T>> || std::is_same_v<BinaryOp, std::multiplies<>>;
+
+// Reduces n contiguous elements with several independent accumulators, so the adds of different lanes overlap.
+// Without intrinsics for T the lanes are plain arrays, which the compiler turns into vector code for integers
+template<typename T, typename BinaryOp>
+T reduce_lanes(T const* data, std::size_t n)
+{
+    T const identity = is_plus_v<T, BinaryOp> ? T(0) : T(1);
+    std::size_t i = 0;
+    T acc = identity;
+    if constexpr (simd_lanes<T>::width != 0)
+    {
+        using lanes = simd_lanes<T>;
+        constexpr std::size_t width = lanes::width;
+        constexpr std::size_t unroll = 4; // Four registers in flight hide the latency of the add
+        auto const combine = [](typename lanes::reg a, typename lanes::reg b)
+        {
+            if constexpr (is_plus_v<T, BinaryOp>)
+            {
+                return lanes::add(a, b);
+            }
+            else
+            {
+                return lanes::mul(a, b);
+            }
+        };
+        typename lanes::reg r[unroll];
+        for (auto& reg : r)
+        {
+            reg = lanes::set1(identity);
+        }
+        for (; i + width * unroll <= n; i += width * unroll)
+        {
+            for (std::size_t k = 0; k < unroll; k++)
+            {
+                r[k] = combine(r[k], lanes::load(data + i + k * width));
+            }
+        }
+        for (; i + width <= n; i += width)
+        {
+            r[0] = combine(r[0], lanes::load(data + i));
+        }
+        T out[width];
+        lanes::store(out, combine(combine(r[0], r[1]), combine(r[2], r[3])));
+        for (T v : out)
+        {
+            acc = BinaryOp()(acc, v);
+        }
+    }
+    else
+    {
+        constexpr std::size_t width = 4 * 16 / sizeof(T) > 0 ? 4 * 16 / sizeof(T) : 1; // Four 128-bit registers
+        T lane[width];
+        std::fill(std::begin(lane), std::end(lane), identity);
+        for (; i + width <= n; i += width)
+        {
+            for (std::size_t k = 0; k < width; k++)
+            {
+                lane[k] = BinaryOp()(lane[k], data[i + k]);
+            }
+        }
+        for (T v : lane)
+        {
+            acc = BinaryOp()(acc, v);
+        }
+    }
+    for (; i < n; i++) // Tail
+    {
+        acc = BinaryOp()(acc, data[i]);
+    }
+    return acc;
+}
+
+// Primary template: the scalar std::accumulate, for any type and operation
+template<typename T, typename BinaryOp, typename Order, typename = void>
+struct reduce_kernel
+{
+    template<typename Iterator>
+    static T run(Iterator first, Iterator last, T init, BinaryOp op)
+    {
+        return std::accumulate(first, last, std::move(init), op);
+    }
+};
+// Arithmetic types (not bool) with std::plus or std::multiplies, when reassociation is allowed
+template<typename T, typename BinaryOp, typename Order>
+struct reduce_kernel<T, BinaryOp, Order, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool> &&
+    (is_plus_v<T, BinaryOp> || is_multiplies_v<T, BinaryOp>) &&
+    (std::is_integral_v<T> || std::is_same_v<Order, relaxed_fp_order>)>>
+{
+    template<typename Iterator>
+    static T run(Iterator first, Iterator last, T init, BinaryOp op)
+    {
+        if constexpr (std::contiguous_iterator<Iterator> && std::is_same_v<std::iter_value_t<Iterator>, T>)
+        {
+            return op(init, reduce_lanes<T, BinaryOp>(std::to_address(first), static_cast<std::size_t>(last - first)));
+        }
+        else
+        {
+            return std::accumulate(first, last, init, op); // Lists, or elements converted to T on the way
+        }
+    }
+};
+
+// Listing 2.9 A naive parallel version of std::accumulate
+// The block starts from its first element (first != last): an operation other than + has no known identity to start from
+template<typename Iterator, typename T, typename Order = strict_fp_order, typename BinaryOp = std::plus<T>>
+struct accumulate_block
+{
+    BinaryOp op{};
+    void operator() (Iterator first, Iterator last, T& result)
+    {
+        T seed = *first;
+        result = reduce_kernel<T, BinaryOp, Order>::run(std::next(first), last, std::move(seed), op);
+    }
+};
+// Minimum distance between objects written by different threads, so they never share a cache line.
+// Every write to a shared line invalidates it for the other cores (false sharing) and the line ping-pongs between them
+#ifdef __cpp_lib_hardware_interference_size
+constexpr std::size_t cache_line_size = std::hardware_destructive_interference_size;
+#else
+constexpr std::size_t cache_line_size = 64; // Current x86 and most ARM cores
+#endif
+
+// One result slot per thread, each on its own cache line. In a packed std::vector<T> neighbouring slots share a line,
+// so threads writing their partial results slow each other down, more so with every core added
+template<typename T>
+class per_thread_slots
+{
+    struct alignas(std::max(cache_line_size, alignof(T))) slot
+    {
+        T value{};
+    };
+    std::vector<slot> slots; // std::allocator honours the over-alignment since C++17
+public:
+    explicit per_thread_slots(std::size_t count) :
+        slots(count)
+    {}
+    T& operator[](std::size_t i) { return slots[i].value; }
+    T const& operator[](std::size_t i) const { return slots[i].value; }
+    std::size_t size() const { return slots.size(); }
+    // Combines the slots in order, like std::accumulate
+    template<typename BinaryOp = std::plus<>>
+    T reduce(T init, BinaryOp op = BinaryOp())
+    {
+        for (auto& s : slots)
+        {
+            init = op(std::move(init), std::move(s.value));
+        }
+        return init;
+    }
+};
+
+// Enough threads for at least min_per_thread elements each, but not more than the hardware (or a pool) can run
+unsigned long choose_num_threads(unsigned long length, unsigned long min_per_thread,
+    unsigned long hardware_threads = std::thread::hardware_concurrency())
+{
+    unsigned long const max_threads = (length + min_per_thread - 1) / min_per_thread;
+    return std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads); // Avoid oversubscription
+}
+// Like std::accumulate(first, last, init, op), op must be associative. std::plus and std::multiplies of arithmetic
+// types use the vector kernels. Pass relaxed_fp_order() to vectorize float and double too. The blocks are combined
+// in a different order than std::accumulate anyway, relaxed order goes further and reassociates inside every block
+template<typename Iterator, typename T, typename BinaryOp, typename Order = strict_fp_order,
+    typename = std::enable_if_t<std::is_invocable_r_v<T, BinaryOp&, T, T>>>
+T parallel_accumulate(Iterator first, Iterator last, T init, BinaryOp op, Order = Order())
+{
+    unsigned long const length = std::distance(first, last);
+    if (!length)
+    {
+        return init; // Nothing to accumulate
+    }
+    unsigned long const min_per_thread = 25; // Don't start a thread for less than 25 elements
+    unsigned long const num_threads = choose_num_threads(length, min_per_thread);
+    unsigned long const block_size = length / num_threads;
+
+    per_thread_slots<T> results(num_threads); // Declared before threads, so it outlives them
+    std::vector<joining_thread> threads(num_threads - 1); // One less, because the current thread is running too
+    Iterator block_start = first;
+    for (unsigned long i = 0; i < (num_threads - 1); i++)
+    {
+        Iterator block_end = block_start;
+        std::advance(block_end, block_size);
+        threads[i] = joining_thread(accumulate_block<Iterator, T, Order, BinaryOp>{ op }, block_start, block_end, std::ref(results[i]));
+        block_start = block_end;
+    }
+    accumulate_block<Iterator, T, Order, BinaryOp>{ op }(block_start, last, results[num_threads - 1]); // Final block is processed in the current thread
+    for (auto& entry : threads)
+    {
+        entry.join();
+    }
+    return results.reduce(init, op);
+} // If anything above throws (e.g. std::system_error from the thread creation), joining_thread joins the started threads
+// The sum, as in Listing 2.9
+template<typename Iterator, typename T, typename Order = strict_fp_order,
+    typename = std::enable_if_t<!std::is_invocable_v<Order&, T, T>>>
+T parallel_accumulate(Iterator first, Iterator last, T init, Order order = Order())
+{
+    return parallel_accumulate(first, last, std::move(init), std::plus<T>(), order);
+}
+// T must be default constructible, because results are stored in per_thread_slots<T>
+// The result may differ from std::accumulate for non-associative operations (e.g. float addition)
+
+
+
+
+
+/***************************/
+/* 2.5 Identifying threads */
+/***************************/
+
+// std::thread::id only tells threads apart. What a thread costs comes from the OS, through native_handle().
+// Polled every second, the differences between two snapshots tell why a pool is slow:
+//     cpu_time growing by less than the interval while involuntary switches climb: the thread is ready to run but
+//     waits for a core, more threads are running than hardware_concurrency() (2.4) allows
+//     voluntary switches climbing: it blocks, on a lock, on I/O, or as an idle worker going to sleep
+//     migrations climbing: the scheduler moves it between cores and its cache is lost, see thread_attributes::cpus
+struct thread_stats
+{
+    std::chrono::nanoseconds cpu_time{ 0 }; // User and system time
+    std::uint64_t voluntary_switches = 0;
+    std::uint64_t involuntary_switches = 0;
+    std::uint64_t migrations = 0; // 0 if the kernel doesn't show them (no CONFIG_SCHED_DEBUG)
+    int cpu = -1; // CPU the thread ran on last
+};
+
+// One clock_gettime() and three small /proc reads: tens of microseconds per thread, fine every second, not per task.
+// Empty for a thread that has exited, and on other platforms than Linux
+std::optional<thread_stats> query_thread_stats(std::thread::native_handle_type handle)
+{
+#ifdef __linux__
+    clockid_t clock;
+    timespec cpu_time;
+    if (pthread_getcpuclockid(handle, &clock) != 0 || clock_gettime(clock, &cpu_time) != 0)
+    {
+        return std::nullopt;
+    }
+    pid_t const tid = static_cast<pid_t>(~(clock >> 3)); // The kernel thread id is part of the CPU clock id (CPUCLOCK_PID)
+    if (tid <= 0) // 0 would be the calling thread
+    {
+        return std::nullopt;
+    }
+    thread_stats result;
+    result.cpu_time = std::chrono::seconds(cpu_time.tv_sec) + std::chrono::nanoseconds(cpu_time.tv_nsec);
+    std::string const dir = "/proc/self/task/" + std::to_string(tid) + "/";
+    std::ifstream status(dir + "status");
+    if (!status)
+    {
+        return std::nullopt;
+    }
+    for (std::string line; std::getline(status, line);)
+    {
+        unsigned long long n;
+        if (std::sscanf(line.c_str(), "voluntary_ctxt_switches: %llu", &n) == 1)
+        {
+            result.voluntary_switches = n;
+        }
+        else if (std::sscanf(line.c_str(), "nonvoluntary_ctxt_switches: %llu", &n) == 1)
+        {
+            result.involuntary_switches = n;
+        }
+    }
+    std::ifstream sched(dir + "sched");
+    for (std::string line; std::getline(sched, line);)
+    {
+        unsigned long long n;
+        if (std::sscanf(line.c_str(), "se.nr_migrations : %llu", &n) == 1)
+        {
+            result.migrations = n;
+        }
+    }
+    std::ifstream stat(dir + "stat");
+    std::string line;
+    std::getline(stat, line);
+    std::size_t const name_end = line.rfind(')'); // The name in parentheses may contain spaces
+    if (name_end != std::string::npos)
+    {
+        std::istringstream fields(line.substr(name_end + 1));
+        std::string field;
+        for (int i = 3; i <= 39 && fields >> field; i++) // Field 39 is the processor
+        {
+            if (i == 39)
+            {
+                result.cpu = std::atoi(field.c_str());
+            }
+        }
+    }
+    return result;
+#else
+    (void)handle;
+    return std::nullopt;
+#endif
+}
+std::optional<thread_stats> query_thread_stats(joining_thread& t)
+{
+    if (!t.joinable())
+    {
+        return std::nullopt;
+    }
+    return query_thread_stats(t.as_thread().native_handle());
+}
+std::optional<thread_stats> query_thread_stats(native_thread& t)
+{
+    if (!t.joinable())
+    {
+        return std::nullopt;
+    }
+    return query_thread_stats(t.native_handle());
+}
+std::optional<thread_stats> query_thread_stats(std::thread& t)
+{
+    if (!t.joinable())
+    {
+        return std::nullopt;
+    }
+    return query_thread_stats(t.native_handle());
+}
+
+
+
+
+
+/***************************************************/
+/* 7.2.6 Writing a thread-safe queue without locks */
+/***************************************************/
+
+// Atomics written by different threads are kept on different cache lines (cache_line_size, see 2.4),
+// otherwise every write invalidates the line for the other threads (false sharing)
+// Bounded multi-producer/multi-consumer queue (Dmitry Vyukov's design). No mutex, no allocation after construction.
+// Every slot has a sequence number telling whether it's free for the push at position pos (sequence == pos)
+// or holds the element for the pop at position pos (sequence == pos + 1). Producers only contend on enqueue_pos,
+// consumers only on dequeue_pos, and both are on their own cache lines
+template<typename T>
+class mpmc_queue
+{
+    static_assert(std::is_nothrow_move_constructible_v<T> && std::is_nothrow_move_assignable_v<T>,
+        "a slot is claimed before the element is moved in, moving must not fail");
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+        T* element() noexcept
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+    std::size_t const mask;
+    std::unique_ptr<cell[]> cells;
+    alignas(cache_line_size) std::atomic<std::size_t> enqueue_pos{ 0 };
+    alignas(cache_line_size) std::atomic<std::size_t> dequeue_pos{ 0 };
+
+    static std::size_t round_up_capacity(std::size_t capacity) noexcept
+    {
+        std::size_t size = 2; // A single slot can't tell a full queue from an empty one
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        return size;
+    }
+public:
+    explicit mpmc_queue(std::size_t capacity) : // Rounded up to a power of two
+        mask(round_up_capacity(capacity) - 1), cells(new cell[mask + 1])
+    {
+        for (std::size_t i = 0; i <= mask; i++)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    ~mpmc_queue()
+    {
+        T dropped;
+        while (try_pop(dropped))
+        {
+        }
+    }
+    mpmc_queue(const mpmc_queue&) = delete;
+    mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+    // x is moved from only if the push succeeds. Returns false if the queue is full
+    bool try_push(T&& x) noexcept
+    {
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell& c = cells[pos & mask];
+            std::size_t const seq = c.sequence.load(std::memory_order_acquire);
+            std::intptr_t const dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (dif == 0) // Free for this position, claim it
+            {
+                // seq_cst, so a consumer going to sleep either sees the claim in empty() or is seen by the producer
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    ::new (static_cast<void*>(c.storage)) T(std::move(x));
+                    c.sequence.store(pos + 1, std::memory_order_release); // Publish to the consumer of pos
+                    return true;
+                }
+            }
+            else if (dif < 0) // The slot still holds the element from one lap ago
+            {
+                return false;
+            }
+            else // Another producer claimed pos
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // Moves up to n elements from items with a single claim of consecutive positions. Stops at the first slot
+    // that isn't free. Returns how many were pushed (from the front), 0 if the queue is full
+    std::size_t try_push_bulk(T* items, std::size_t n) noexcept
+    {
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (n != 0)
+        {
+            std::size_t room = 0;
+            while (room < n && room <= mask && cells[(pos + room) & mask].sequence.load(std::memory_order_acquire) == pos + room)
+            {
+                ++room;
+            }
+            if (room == 0)
+            {
+                std::size_t const seq = cells[pos & mask].sequence.load(std::memory_order_acquire);
+                if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos) < 0)
+                {
+                    return 0; // Full
+                }
+                pos = enqueue_pos.load(std::memory_order_relaxed); // Another producer claimed pos
+                continue;
+            }
+            // No claimed position can become busy again, only the claim itself can be lost to another producer
+            if (enqueue_pos.compare_exchange_weak(pos, pos + room, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                for (std::size_t i = 0; i < room; i++)
+                {
+                    cell& c = cells[(pos + i) & mask];
+                    ::new (static_cast<void*>(c.storage)) T(std::move(items[i]));
+                    c.sequence.store(pos + i + 1, std::memory_order_release);
+                }
+                return room;
+            }
+        }
+        return 0;
+    }
+    // Returns false if the queue is empty (or the next element is claimed but not written yet)
+    bool try_pop(T& out) noexcept
+    {
+        std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell& c = cells[pos & mask];
+            std::size_t const seq = c.sequence.load(std::memory_order_acquire);
+            std::intptr_t const dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    out = std::move(*c.element());
+                    c.element()->~T();
+                    c.sequence.store(pos + mask + 1, std::memory_order_release); // Free for the producer of the next lap
+                    return true;
+                }
+            }
+            else if (dif < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    bool empty() const noexcept // Only a snapshot while other threads push and pop
+    {
+        return enqueue_pos.load(std::memory_order_seq_cst) == dequeue_pos.load(std::memory_order_seq_cst);
+    }
+    std::size_t size_approx() const noexcept // Also a snapshot. Counts pushes that are still writing their slot
+    {
+        std::size_t const dequeued = dequeue_pos.load(std::memory_order_relaxed); // First, so it can't pass enqueued
+        return enqueue_pos.load(std::memory_order_relaxed) - dequeued;
+    }
+    std::size_t capacity() const noexcept
+    {
+        return mask + 1;
+    }
+};
+
+
+
+
+
+/******************************************************/
+/* 8.1.3 Dividing a sequence of tasks between threads */
+/******************************************************/
+
+// A pipeline gives each step of the processing its own threads and passes the items from step to step,
+// like the loop of edit_document (2.1.4): one step reads a command, the next one processes it.
+// Threads are started once per stage, not per item, and each stage can have as many as its step needs
+
+// Bounded channel between two stages. Pushing and popping is lock-free (an mpmc_queue), the mutex is
+// only taken to sleep while the channel is full or empty, and to wake a sleeper
+template<typename T>
+class channel
+{
+    mpmc_queue<T> items;
+    std::atomic<bool> closed{ false };
+    alignas(cache_line_size) std::atomic<unsigned> waiting_pops{ 0 }; // Incremented and decremented under m only
+    alignas(cache_line_size) std::atomic<unsigned> waiting_pushes{ 0 };
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    // A sleeper announces itself with an increment, then looks at the queue again. Read-modify-writes of waiting
+    // read its latest value: either this one comes later and sees the sleeper, or the sleeper's comes later and
+    // synchronizes with this one, so it sees the change. Plain loads and stores would need a fence on both sides
+    void wake(std::atomic<unsigned>& waiting, std::condition_variable& cond)
+    {
+        if (waiting.fetch_add(0, std::memory_order_acq_rel) != 0) // Common case: no lock, no syscall
+        {
+            std::lock_guard<std::mutex> lk(m); // The sleeper has checked and is waiting, or hasn't taken the lock yet
+            cond.notify_one();
+        }
+    }
+public:
+    explicit channel(std::size_t capacity) : // Rounded up to a power of two
+        items(capacity)
+    {}
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+
+    // Blocks while the channel is full (backpressure). Returns false if the channel is closed
+    bool push(T value)
+    {
+        for (;;)
+        {
+            if (closed.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            if (items.try_push(std::move(value)))
+            {
+                wake(waiting_pops, not_empty);
+                return true;
+            }
+            std::unique_lock<std::mutex> lk(m);
+            waiting_pushes.fetch_add(1, std::memory_order_acq_rel);
+            if (!closed.load(std::memory_order_relaxed) && items.size_approx() >= items.capacity())
+            {
+                not_full.wait(lk); // Spurious wake-ups just go round the loop
+            }
+            waiting_pushes.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    // Blocks while the channel is empty. Returns false once it's closed and all its items are popped
+    bool pop(T& out)
+    {
+        for (;;)
+        {
+            if (items.try_pop(out))
+            {
+                wake(waiting_pushes, not_full);
+                return true;
+            }
+            std::unique_lock<std::mutex> lk(m);
+            waiting_pops.fetch_add(1, std::memory_order_acq_rel);
+            bool const finished = closed.load(std::memory_order_relaxed) && items.empty();
+            if (!finished && items.empty()) // Not empty: an element is still being written, try again
+            {
+                not_empty.wait(lk);
+            }
+            waiting_pops.fetch_sub(1, std::memory_order_relaxed);
+            if (finished)
+            {
+                return false;
+            }
+        }
+    }
+    // Called by the producers after their last push has returned. Later pushes fail, pops drain what's left
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            closed.store(true, std::memory_order_release);
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+enum class stage_order
+{
+    ordered, // Results leave the stage in the order their items entered the pipeline
+    unordered // As soon as they are ready. No reordering wait, but the order is lost for the next stages
+};
+
+// Stages without output (sinks) pass on nothing, their items carry a std::monostate
+template<typename T>
+using stage_value_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+template<typename T>
+struct pipeline_item
+{
+    std::uint64_t seq = 0; // Position in the pipeline input
+    std::optional<T> value; // Empty if an earlier stage threw. The position is still passed on, ordered stages wait for it
+};
+
+// Shared by the stages. A token is taken for every item pushed and given back when the item leaves the pipeline,
+// so at most max_in_flight items are inside: every channel is big enough to hold them all, and an ordered stage
+// needs room for max_in_flight results to reorder them
+struct pipeline_state
+{
+    std::size_t const max_in_flight;
+    std::counting_semaphore<> tokens;
+    std::mutex push_mutex;
+    std::uint64_t next_seq = 0; // Guarded by push_mutex. Only accepted items use one up: ordered stages see no gap
+    std::atomic<bool> failed{ false };
+    std::exception_ptr error; // Written by the first failing call, read by wait() after the workers are joined
+
+    explicit pipeline_state(std::size_t max_in_flight_) :
+        max_in_flight(max_in_flight_), tokens(static_cast<std::ptrdiff_t>(max_in_flight_))
+    {}
+    void fail(std::exception_ptr e) noexcept
+    {
+        if (!failed.exchange(true, std::memory_order_relaxed))
+        {
+            error = std::move(e);
+        }
+    }
+};
+
+class stage_base
+{
+public:
+    virtual ~stage_base() = default;
+    virtual void join() = 0;
+};
+
+// Runs fn on up to parallelism items at once, one thread each. fn is called concurrently,
+// and must be copyable (it's stored in a std::function)
+template<typename In, typename Out>
+class stage : public stage_base
+{
+    using out_channel = channel<pipeline_item<stage_value_t<Out>>>;
+
+    std::shared_ptr<pipeline_state> state;
+    std::shared_ptr<channel<pipeline_item<In>>> input;
+    std::shared_ptr<out_channel> output; // Null for a sink
+    std::function<Out(In)> fn;
+    stage_order const order;
+    std::mutex reorder_mutex;
+    std::vector<std::optional<pipeline_item<stage_value_t<Out>>>> reorder; // Indexed by seq % max_in_flight
+    std::uint64_t next_seq = 0; // Guarded by reorder_mutex. Next position to pass on, the ones in between are in flight
+    std::atomic<unsigned> running;
+    std::vector<joining_thread> threads; // Declared last, so threads are joined before the rest is destroyed
+
+    void emit(pipeline_item<stage_value_t<Out>>&& result)
+    {
+        if (!output->push(std::move(result))) // Closed by ~pipeline: nobody takes results any more
+        {
+            state->tokens.release();
+        }
+    }
+    void emit_in_order(pipeline_item<stage_value_t<Out>>&& result)
+    {
+        std::lock_guard<std::mutex> lk(reorder_mutex);
+        reorder[result.seq % reorder.size()].emplace(std::move(result));
+        for (auto* next = &reorder[next_seq % reorder.size()]; next->has_value(); next = &reorder[next_seq % reorder.size()])
+        {
+            emit(std::move(**next)); // Never blocks: the output channel has room for every item in flight
+            next->reset();
+            ++next_seq;
+        }
+    }
+    void worker_thread()
+    {
+        pipeline_item<In> item;
+        while (input->pop(item))
+        {
+            pipeline_item<stage_value_t<Out>> result{ item.seq, std::nullopt };
+            if (item.value)
+            {
+                try
+                {
+                    if constexpr (std::is_void_v<Out>)
+                    {
+                        fn(std::move(*item.value));
+                    }
+                    else
+                    {
+                        result.value.emplace(fn(std::move(*item.value)));
+                    }
+                }
+                catch (...)
+                {
+                    state->fail(std::current_exception());
+                }
+            }
+            if (!output)
+            {
+                state->tokens.release(); // The item leaves the pipeline
+            }
+            else if (order == stage_order::ordered)
+            {
+                emit_in_order(std::move(result));
+            }
+            else
+            {
+                emit(std::move(result));
+            }
+        }
+        if (running.fetch_sub(1, std::memory_order_acq_rel) == 1 && output)
+        {
+            output->close(); // Last one out: the next stage ends when it has drained the channel
+        }
+    }
+public:
+    stage(std::shared_ptr<pipeline_state> state_, std::shared_ptr<channel<pipeline_item<In>>> input_,
+        std::shared_ptr<out_channel> output_, std::function<Out(In)> fn_, unsigned parallelism, stage_order order_) :
+        state(std::move(state_)), input(std::move(input_)), output(std::move(output_)), fn(std::move(fn_)), order(order_),
+        reorder(order == stage_order::ordered && output ? state->max_in_flight : 0), running(std::max(parallelism, 1u))
+    {
+        unsigned const thread_count = running.load(std::memory_order_relaxed);
+        threads.reserve(thread_count);
+        try
+        {
+            for (unsigned i = 0; i < thread_count; i++)
+            {
+                threads.emplace_back(&stage::worker_thread, this);
+            }
+        }
+        catch (...)
+        {
+            input->close(); // Otherwise the started workers wait forever and joining_thread blocks
+            throw;
+        }
+    }
+    void join() override
+    {
+        for (auto& t : threads)
+        {
+            if (t.joinable())
+            {
+                t.join();
+            }
+        }
+    }
+};
+
+// Typed chain of stages, built from its input type:
+//     auto p = pipeline<std::string>(64).then(read, 4, stage_order::unordered).then(parse, 8).then(show);
+// push() feeds the first stage and blocks while max_in_flight items are inside the pipeline (backpressure).
+// A stage with parallelism 1 after an ordered stage sees the items in the order they were pushed.
+// If the last stage has an output, results are taken with pop(). wait() closes the input, waits for every
+// stage to finish and rethrows the first exception thrown by a stage (its item is dropped, the others go on).
+// The destructor finishes the items already pushed, results not popped by then are dropped
+template<typename In, typename Out = In>
+class pipeline
+{
+    template<typename, typename> friend class pipeline;
+    using out_channel = channel<pipeline_item<stage_value_t<Out>>>;
+
+    std::shared_ptr<pipeline_state> state;
+    std::shared_ptr<channel<pipeline_item<In>>> input;
+    std::shared_ptr<out_channel> output; // Null after a sink
+    std::vector<std::unique_ptr<stage_base>> stages;
+
+    pipeline(std::shared_ptr<pipeline_state> state_, std::shared_ptr<channel<pipeline_item<In>>> input_,
+        std::shared_ptr<out_channel> output_, std::vector<std::unique_ptr<stage_base>> stages_) :
+        state(std::move(state_)), input(std::move(input_)), output(std::move(output_)), stages(std::move(stages_))
+    {}
+public:
+    template<typename U = Out, typename = std::enable_if_t<std::is_same_v<U, In>>>
+    explicit pipeline(std::size_t max_in_flight = 256) :
+        state(std::make_shared<pipeline_state>(std::max<std::size_t>(max_in_flight, 1))),
+        input(std::make_shared<channel<pipeline_item<In>>>(state->max_in_flight)), output(input)
+    {}
+    pipeline(pipeline&&) noexcept = default;
+    pipeline& operator=(pipeline&&) = delete;
+    ~pipeline()
+    {
+        if (!state)
+        {
+            return; // Moved from by then()
+        }
+        input->close();
+        if (output)
+        {
+            output->close(); // The last stage drops its results instead of waiting for room
+        }
+    } // Stages are joined in any order: each one ends once its input is closed and drained
+
+    // Adds a stage calling fn on the results of the current last stage. Doesn't wait for anything
+    template<typename Callable>
+    auto then(Callable fn, unsigned parallelism = 1, stage_order order = stage_order::ordered) &&
+    {
+        static_assert(!std::is_void_v<Out>, "a stage without output ends the pipeline");
+        using next_type = std::invoke_result_t<Callable&, Out>;
+        std::shared_ptr<channel<pipeline_item<stage_value_t<next_type>>>> next_output;
+        if constexpr (!std::is_void_v<next_type>)
+        {
+            next_output = std::make_shared<channel<pipeline_item<next_type>>>(state->max_in_flight);
+        }
+        stages.push_back(std::make_unique<stage<Out, next_type>>(state, output, next_output,
+            std::function<next_type(Out)>(std::move(fn)), parallelism, order));
+        return pipeline<In, next_type>(std::move(state), std::move(input), std::move(next_output), std::move(stages));
+    }
+    // Returns false if the input is closed. Pushes are serialized with each other and with close(): one failing
+    // doesn't leave a position that an ordered stage would wait for forever, and none gets in after the first stage
+    // has drained its input and ended
+    bool push(In value)
+    {
+        state->tokens.acquire();
+        bool accepted;
+        {
+            std::lock_guard<std::mutex> lk(state->push_mutex); // Never held while blocking: the token leaves room
+            accepted = input->push(pipeline_item<In>{ state->next_seq, std::move(value) });
+            if (accepted)
+            {
+                ++state->next_seq;
+            }
+        }
+        if (!accepted)
+        {
+            state->tokens.release();
+        }
+        return accepted;
+    }
+    // Returns false once the input is closed and every result has been popped
+    template<typename U = Out, typename = std::enable_if_t<!std::is_void_v<U>>>
+    bool pop(U& out)
+    {
+        pipeline_item<U> item;
+        while (output->pop(item))
+        {
+            state->tokens.release();
+            if (item.value) // Skips the items dropped by a throwing stage
+            {
+                out = std::move(*item.value);
+                return true;
+            }
+        }
+        return false;
+    }
+    void close()
+    {
+        std::lock_guard<std::mutex> lk(state->push_mutex);
+        input->close();
+    }
+    void wait()
+    {
+        close();
+        for (auto& s : stages)
+        {
+            s->join();
+        }
+        if (state->failed.load(std::memory_order_relaxed))
+        {
+            std::rethrow_exception(state->error);
+        }
+    }
+};
+
+// Word counts of files, printed in the order of filenames. Reading is I/O bound and counting CPU bound,
+// so the stages get different numbers of threads. Only the printing stage needs the input order
+void print_word_counts(std::vector<std::string> const& filenames)
+{
+    auto p = pipeline<std::string>(64)
+        .then([](std::string name)
+        {
+            std::ifstream file(name);
+            std::stringstream text;
+            text << file.rdbuf();
+            return std::make_pair(std::move(name), text.str());
+        }, 4, stage_order::unordered)
+        .then([](std::pair<std::string, std::string> document)
+        {
+            std::istringstream words(document.second);
+            return std::make_pair(std::move(document.first),
+                std::distance(std::istream_iterator<std::string>(words), std::istream_iterator<std::string>()));
+        }, std::max(std::thread::hardware_concurrency(), 1u), stage_order::ordered)
+        .then([](std::pair<std::string, std::ptrdiff_t> count)
+        {
+            std::printf("%s: %td\n", count.first.c_str(), count.second);
+        }); // One thread, after an ordered stage
+    for (auto const& name : filenames)
+    {
+        p.push(name);
+    }
+    p.wait();
+}
+
+
+
+
+
+
+/********************/
+/* 9.1 Thread pools */
+/********************/
+
+// Starting a thread costs tens of microseconds, which dominates short tasks.
+// A thread pool starts a fixed number of worker threads once and hands tasks to them through a queue
+
+// Arguments of a task are decay-copied like in std::thread, and std::ref is unwrapped like in std::make_tuple
+template<typename T>
+decltype(auto) unwrap_arg(T&& arg)
+{
+    if constexpr (std::is_same_v<std::decay_t<T>, std::reference_wrapper<std::unwrap_reference_t<std::decay_t<T>>>>)
+    {
+        return arg.get();
+    }
+    else
+    {
+        return std::forward<T>(arg);
+    }
+}
+// Packs a callable and its arguments into one callable without arguments. When all of them are trivially copyable
+// (ints, ids, pointers, member function pointers as in &X::do_lengthy_work with &my_x) they're captured one by one
+// and the result is trivially copyable too, so unique_task stores it inline and moves it with a memcpy.
+// std::tuple is never trivially copyable, so it's used only for the other arguments (strings, vectors...)
+template<typename Callable, typename ... Args>
+auto bind_args(Callable&& func, Args&& ... args)
+{
+    if constexpr (std::is_trivially_copyable_v<std::decay_t<Callable>> && (std::is_trivially_copyable_v<std::decay_t<Args>> && ...))
+    {
+        return [func = std::decay_t<Callable>(std::forward<Callable>(func)), ...args = std::decay_t<Args>(std::forward<Args>(args))]() mutable
+        {
+            return std::invoke(std::move(func), unwrap_arg(std::move(args))...);
+        };
+    }
+    else
+    {
+        return [func = std::decay_t<Callable>(std::forward<Callable>(func)), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+        {
+            return std::apply(std::move(func), std::move(args));
+        };
+    }
+}
+
+// std::packaged_task is move-only, so it can't be stored in std::function (requires copyable callables)
+// unique_task is a move-only type-erased callable. Callables up to inline_size bytes (e.g. a lambda owning a
+// std::unique_ptr<big_object>, or a std::packaged_task) are stored inside the object, so wrapping them doesn't allocate
+class unique_task
+{
+public:
+    static constexpr std::size_t inline_size = 64;
+private:
+    struct vtable
+    {
+        void (*call)(void* storage);
+        void (*move)(void* to, void* from) noexcept; // Move-constructs into to and destroys from. nullptr: memcpy
+        void (*destroy)(void* storage) noexcept; // nullptr: nothing to destroy
+    };
+    template<typename F>
+    static constexpr bool fits_inline = sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<F>; // Moving the task must not throw
+    template<typename F>
+    static constexpr vtable trivial_vtable{ // Trivially copyable and inline: only the call is indirect
+        [](void* s) { (*static_cast<F*>(s))(); },
+        nullptr,
+        nullptr
+    };
+    template<typename F>
+    static constexpr vtable inline_vtable{
+        [](void* s) { (*static_cast<F*>(s))(); },
+        [](void* to, void* from) noexcept
+        {
+            ::new (to) F(std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* s) noexcept { static_cast<F*>(s)->~F(); }
+    };
+    template<typename F>
+    static constexpr vtable heap_vtable{ // Too big: storage holds a F*
+        [](void* s) { (**static_cast<F**>(s))(); },
+        [](void* to, void* from) noexcept { *static_cast<F**>(to) = *static_cast<F**>(from); },
+        [](void* s) noexcept { delete *static_cast<F**>(s); }
+    };
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    vtable const* vt = nullptr;
+
+    void reset() noexcept
+    {
+        if (vt)
+        {
+            if (vt->destroy)
+            {
+                vt->destroy(storage);
+            }
+            vt = nullptr;
+        }
+    }
+    void move_storage(unique_task& other) noexcept
+    {
+        if (other.vt->move)
+        {
+            other.vt->move(storage, other.storage);
+        }
+        else
+        {
+            std::memcpy(storage, other.storage, inline_size); // Fixed size, a few vector moves
+        }
+    }
+public:
+    unique_task() noexcept = default;
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, unique_task>>>
+    unique_task(F&& f)
+    {
+        using callable = std::decay_t<F>;
+        if constexpr (fits_inline<callable> && std::is_trivially_copyable_v<callable>)
+        {
+            ::new (static_cast<void*>(storage)) callable(std::forward<F>(f));
+            vt = &trivial_vtable<callable>;
+        }
+        else if constexpr (fits_inline<callable>)
+        {
+            ::new (static_cast<void*>(storage)) callable(std::forward<F>(f));
+            vt = &inline_vtable<callable>;
+        }
+        else
+        {
+            ::new (static_cast<void*>(storage)) callable*(new callable(std::forward<F>(f)));
+            vt = &heap_vtable<callable>;
+        }
+    }
+    unique_task(unique_task&& other) noexcept :
+        vt(other.vt)
+    {
+        if (vt)
+        {
+            move_storage(other);
+            other.vt = nullptr;
+        }
+    }
+    unique_task& operator=(unique_task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            if (other.vt)
+            {
+                move_storage(other);
+                vt = other.vt;
+                other.vt = nullptr;
+            }
+        }
+        return *this;
+    }
+    unique_task(const unique_task&) = delete;
+    unique_task& operator=(const unique_task&) = delete;
+    ~unique_task()
+    {
+        reset();
+    }
+    void operator() ()
+    {
+        vt->call(storage);
+    }
+    explicit operator bool() const noexcept
+    {
+        return vt != nullptr;
+    }
+};
+// Chase-Lev work-stealing deque (memory orders follow Le, Pop, Cohen, Zappa Nardelli 2013)
+// The owner pushes and pops at the bottom (LIFO, the newest task is still in cache),
+// other threads steal from the top (FIFO, the oldest task is usually the biggest piece of work)
+// Only trivially copyable values (pointers) can be stored: a thief may read a slot and then lose the race for it
+template<typename T>
+class work_stealing_deque
+{
+    static_assert(std::is_trivially_copyable_v<T>, "work_stealing_deque stores trivially copyable values only");
+    struct ring
+    {
+        std::int64_t const capacity; // Power of two
+        std::unique_ptr<std::atomic<T>[]> slots;
+        explicit ring(std::int64_t capacity_) :
+            capacity(capacity_), slots(new std::atomic<T>[capacity_])
+        {}
+        T load(std::int64_t i) const noexcept
+        {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void store(std::int64_t i, T x) noexcept
+        {
+            slots[i & (capacity - 1)].store(x, std::memory_order_relaxed);
+        }
+    };
+    alignas(cache_line_size) std::atomic<std::int64_t> top{ 0 }; // Thieves and owner, on its own cache line
+    alignas(cache_line_size) std::atomic<std::int64_t> bottom{ 0 }; // Owner only writes
+    std::atomic<ring*> array;
+    std::vector<std::unique_ptr<ring>> rings; // Owner only. Old rings are kept, a thief may still read them
+public:
+    explicit work_stealing_deque(std::int64_t initial_capacity = 256)
+    {
+        rings.push_back(std::make_unique<ring>(initial_capacity));
+        array.store(rings.back().get(), std::memory_order_relaxed);
+    }
+    work_stealing_deque(const work_stealing_deque&) = delete;
+    work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+    void push(T x) // Owner thread only
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed);
+        std::int64_t const t = top.load(std::memory_order_acquire);
+        ring* a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) // Full, double the capacity
+        {
+            auto bigger = std::make_unique<ring>(a->capacity * 2);
+            for (std::int64_t i = t; i < b; i++)
+            {
+                bigger->store(i, a->load(i));
+            }
+            a = bigger.get();
+            rings.push_back(std::move(bigger));
+            array.store(a, std::memory_order_release);
+        }
+        a->store(b, x);
+        bottom.store(b + 1, std::memory_order_seq_cst); // seq_cst, so a thread going to sleep either sees the task or is seen
+    }
+    bool pop(T& x) // Owner thread only
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed) - 1;
+        ring* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_seq_cst); // Reserve the bottom slot before looking at top
+        std::int64_t t = top.load(std::memory_order_seq_cst);
+        if (t > b) // Empty
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        x = a->load(b);
+        if (t == b) // Last task, a thief may be taking it right now
+        {
+            bool const won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+    bool steal(T& x) // Any thread
+    {
+        std::int64_t t = top.load(std::memory_order_seq_cst);
+        std::int64_t const b = bottom.load(std::memory_order_seq_cst);
+        if (t >= b)
+        {
+            return false;
+        }
+        ring* a = array.load(std::memory_order_acquire);
+        x = a->load(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed); // Fails if another thread took it
+    }
+    bool empty() const noexcept
+    {
+        return bottom.load(std::memory_order_seq_cst) <= top.load(std::memory_order_seq_cst);
+    }
+    std::size_t size_approx() const noexcept
+    {
+        std::int64_t const size = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+        return size > 0 ? static_cast<std::size_t>(size) : 0; // Negative while the owner pops the last task
+    }
+};
+
+// Memory resource with a cache per thread. Objects that tasks create and destroy (big_object, widget_data,
+// buffers) come from slabs of the current thread, without a lock and without touching the other cores' lines.
+// A block freed by another thread goes back to its owner through a lock-free list, the owner reuses it later.
+// Blocks up to max_block_size are served from slab_size slabs, larger ones come from upstream directly.
+// When a thread exits, its cache (with its free blocks) is adopted by the next thread that needs one.
+// The resource releases every slab when destroyed, so it must outlive the threads and objects using it
+class thread_cache_resource : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t slab_size = 256 * 1024;
+    static constexpr std::size_t max_block_size = 32 * 1024;
+private:
+    static constexpr std::size_t min_block_size = 16; // Room for a remote_block, multiple of max_align_t
+    static constexpr std::size_t class_count = 12; // 16, 32, ... 32K
+    struct free_block
+    {
+        free_block* next;
+    };
+    struct remote_block // Freed by a thread that doesn't own it
+    {
+        remote_block* next;
+        std::size_t size_class;
+    };
+    struct thread_cache
+    {
+        free_block* free_lists[class_count] = {}; // Owner only
+        char* bump = nullptr; // Rest of the newest slab, owner only
+        char* bump_end = nullptr;
+        std::vector<void*> slabs; // Owner only, released by the resource
+        alignas(cache_line_size) std::atomic<remote_block*> remote_frees{ nullptr }; // Pushed by other threads
+        std::atomic<bool> in_use{ true }; // false after the owner thread has exited
+        std::atomic<bool> released{ false }; // The resource is gone, a thread can drop its binding
+    };
+    struct slab_header // At the start of every slab. Slabs are aligned to slab_size, so a block finds its slab
+    {
+        thread_cache* owner;
+    };
+    static constexpr std::size_t slab_header_size = cache_line_size;
+
+    struct thread_binding
+    {
+        std::uint64_t resource_id;
+        std::shared_ptr<thread_cache> cache;
+    };
+    struct thread_bindings
+    {
+        std::vector<thread_binding> bindings;
+        ~thread_bindings()
+        {
+            for (auto& b : bindings)
+            {
+                b.cache->in_use.store(false, std::memory_order_release); // Publishes the free lists to the adopter
+            }
+        }
+    };
+    static inline thread_local thread_bindings current_thread;
+    static inline std::atomic<std::uint64_t> next_id{ 1 };
+
+    std::uint64_t const id = next_id.fetch_add(1, std::memory_order_relaxed); // An address could be reused
+    std::pmr::memory_resource* const upstream;
+    std::mutex m;
+    std::vector<std::shared_ptr<thread_cache>> caches; // Guarded by m
+
+    static std::size_t size_class(std::size_t bytes) noexcept
+    {
+        std::size_t c = 0;
+        while ((min_block_size << c) < bytes)
+        {
+            ++c;
+        }
+        return c;
+    }
+    static bool from_slab(std::size_t bytes, std::size_t alignment) noexcept
+    {
+        return bytes <= max_block_size && alignment <= alignof(std::max_align_t);
+    }
+    thread_cache* bound_cache() const noexcept
+    {
+        for (auto const& b : current_thread.bindings) // Usually a single resource, so a single entry
+        {
+            if (b.resource_id == id)
+            {
+                return b.cache.get();
+            }
+        }
+        return nullptr;
+    }
+    thread_cache& local_cache()
+    {
+        if (thread_cache* const bound = bound_cache())
+        {
+            return *bound;
+        }
+        auto& bindings = current_thread.bindings; // Bindings to destroyed resources (e.g. of old pools) are dropped
+        bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+            [](thread_binding const& b) { return b.cache->released.load(std::memory_order_relaxed); }), bindings.end());
+        std::shared_ptr<thread_cache> cache;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            for (auto const& c : caches)
+            {
+                bool expected = false;
+                if (c->in_use.load(std::memory_order_relaxed) == false &&
+                    c->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    cache = c;
+                    break;
+                }
+            }
+            if (!cache)
+            {
+                cache = std::make_shared<thread_cache>();
+                caches.push_back(cache);
+            }
+        }
+        bindings.push_back({ id, cache });
+        return *cache;
+    }
+    void take_remote_frees(thread_cache& cache) noexcept
+    {
+        for (remote_block* b = cache.remote_frees.exchange(nullptr, std::memory_order_acquire); b;)
+        {
+            remote_block* const next = b->next;
+            std::size_t const c = b->size_class;
+            free_block* const f = ::new (static_cast<void*>(b)) free_block{ cache.free_lists[c] };
+            cache.free_lists[c] = f;
+            b = next;
+        }
+    }
+    void* carve(thread_cache& cache, std::size_t block_size)
+    {
+        if (static_cast<std::size_t>(cache.bump_end - cache.bump) < block_size)
+        {
+            cache.slabs.reserve(cache.slabs.size() + 1); // Can't fail after the slab is allocated
+            char* const slab = static_cast<char*>(upstream->allocate(slab_size, slab_size));
+            ::new (static_cast<void*>(slab)) slab_header{ &cache };
+            cache.slabs.push_back(slab);
+            cache.bump = slab + slab_header_size; // What was left of the old slab is given up
+            cache.bump_end = slab + slab_size;
+        }
+        void* const p = cache.bump;
+        cache.bump += block_size;
+        return p;
+    }
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (!from_slab(bytes, alignment))
+        {
+            return upstream->allocate(bytes, alignment);
+        }
+        std::size_t const c = size_class(bytes);
+        thread_cache& cache = local_cache();
+        if (!cache.free_lists[c])
+        {
+            take_remote_frees(cache);
+        }
+        if (free_block* const f = cache.free_lists[c])
+        {
+            cache.free_lists[c] = f->next;
+            return f;
+        }
+        return carve(cache, min_block_size << c);
+    }
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        if (!from_slab(bytes, alignment))
+        {
+            upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+        std::size_t const c = size_class(bytes);
+        auto const slab = reinterpret_cast<slab_header*>(reinterpret_cast<std::uintptr_t>(p) & ~(slab_size - 1));
+        thread_cache* const owner = slab->owner;
+        if (owner == bound_cache()) // A thread that only frees doesn't get a cache
+        {
+            owner->free_lists[c] = ::new (p) free_block{ owner->free_lists[c] };
+            return;
+        }
+        remote_block* const b = ::new (p) remote_block{ owner->remote_frees.load(std::memory_order_relaxed), c };
+        while (!owner->remote_frees.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+public:
+    explicit thread_cache_resource(std::pmr::memory_resource* upstream_ = std::pmr::get_default_resource()) :
+        upstream(upstream_)
+    {}
+    ~thread_cache_resource() override
+    {
+        for (auto const& c : caches)
+        {
+            for (void* slab : c->slabs)
+            {
+                upstream->deallocate(slab, slab_size, slab_size);
+            }
+            c->released.store(true, std::memory_order_relaxed);
+        }
+    }
+    thread_cache_resource(const thread_cache_resource&) = delete;
+    thread_cache_resource& operator=(const thread_cache_resource&) = delete;
+};
+
+// Tells the core that the thread is in a spin-wait loop: saves power, and on a hyper-threaded core
+// leaves the execution units to the sibling thread
+void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Faults in the first bytes of the calling thread's stack, one page per frame. The write after the recursive call
+// keeps the compiler from turning it into a loop that reuses a single frame
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void touch_stack(std::size_t bytes)
+{
+    volatile char page[4096];
+    page[0] = 0;
+    if (bytes > sizeof(page))
+    {
+        touch_stack(bytes - sizeof(page));
+    }
+    page[sizeof(page) - 1] = 0;
+}
+// How much of its stack the calling thread can touch that way: the stack size less the frames already in use and
+// the per-frame overhead of touch_stack. SIZE_MAX if the stack size isn't known
+std::size_t touchable_stack_bytes() noexcept
+{
+    std::size_t size = SIZE_MAX;
+#ifdef __linux__
+    pthread_attr_t self;
+    if (pthread_getattr_np(pthread_self(), &self) == 0)
+    {
+        void* stack = nullptr;
+        if (pthread_attr_getstack(&self, &stack, &size) != 0)
+        {
+            size = SIZE_MAX;
+        }
+        pthread_attr_destroy(&self);
+    }
+#endif
+    if (size == SIZE_MAX)
+    {
+        return size;
+    }
+    std::size_t const margin = size / 8 + 64 * 1024;
+    return size > margin ? size - margin : 0;
+}
+
+// What a worker does when it finds no task. Waking a sleeping worker costs a few microseconds (a futex syscall
+// and a context switch) on every burst of work. A spinning worker starts at once, but uses its core meanwhile
+enum class idle_policy
+{
+    park, // Sleep on the condition variable at once. Nothing used while idle, best for batch work and power
+    spin, // Poll until work arrives, never sleep. Lowest latency, every idle worker keeps a core busy
+    spin_then_yield, // Poll, then poll with a yield in between (other threads can run), then sleep
+    spin_then_park // Poll for a while, then sleep. Short gaps between bursts don't pay the wake-up
+};
+
+// Lane of a task in the pool queue. A worker takes from the high lane first, then timed tasks (earliest deadline
+// first), then normal, then low. Subtasks of a running task stay on its worker's deque whatever the lane
+enum class task_priority
+{
+    high, // Interactive work, e.g. handling user input: runs ahead of everything queued
+    normal,
+    low // Background work, e.g. loading documents
+};
+
+struct thread_pool_options
+{
+    unsigned thread_count = 0; // Maximum number of workers. 0: hardware_concurrency(), or the number of physical cores if pinned
+    bool lazy = false; // Start with min_threads workers, then one more whenever a push finds no idle worker to take it
+    unsigned min_threads = 0; // Lazy and shrinking pools keep at least this many workers
+    std::chrono::milliseconds idle_timeout{ 0 }; // A worker asleep this long without work exits (down to min_threads), 0: never
+    bool pin_to_physical_cores = false; // One worker per physical core, allocating from that core's NUMA node
+    thread_attributes worker_attributes{}; // Placement and stack of every worker. cpus and memory are replaced if pinned
+    std::size_t queue_capacity = 4096; // Tasks submitted from outside the pool waiting to start
+    idle_policy idle = idle_policy::park;
+    unsigned spin_polls = 200; // Polls before yielding or sleeping. The pause between polls doubles from 1 up to max_pause
+    unsigned max_pause = 64; // cpu_relax() calls. idle_policy::spin workers never sleep, so they never time out
+    unsigned yield_polls = 50; // spin_then_yield: polls with a yield in between, before sleeping
+    unsigned lane_share = 8; // Every n-th task a worker takes is looked for from a lower lane first. 0: strict priority
+};
+
+// Snapshot of thread_pool::stats(). Counters are totals since the pool started, take two snapshots to get rates.
+// Sizing: workers that are idle most of the time mean too many threads,
+// tasks waiting long before they start while no worker is idle mean too few
+struct thread_pool_stats
+{
+    struct worker
+    {
+        std::uint64_t tasks_run = 0;
+        std::uint64_t steals = 0; // Tasks taken from another worker's deque
+        std::uint64_t failed_steals = 0; // Deques found empty or lost to another thief
+        std::chrono::nanoseconds idle_time{ 0 }; // Waiting for work, spinning or asleep
+        std::size_t local_queue_depth = 0;
+    };
+    std::vector<worker> workers; // Back: threads outside the pool running tasks in run_pending_task(), no failed_steals
+    std::size_t pool_queue_depth = 0; // All lanes
+    std::size_t timed_queue_depth = 0;
+    std::size_t max_sampled_queue_depth = 0; // Pool queue depth seen by sampled submissions
+    std::uint64_t sampled_tasks = 0; // Every wait_sample_period-th task submitted by a thread is timed
+    std::chrono::nanoseconds mean_wait_before_start{ 0 };
+    std::chrono::nanoseconds max_wait_before_start{ 0 };
+};
+
+// 9.1.5 Work-stealing thread pool
+// Tasks submitted from outside go to the shared pool queue. Tasks submitted by a worker (subtasks) go to its own
+// deque, so recursive work stays on the core that produced it. Idle workers steal from the other deques.
+// The pool queue has a lane per task_priority and a lane of timed tasks. Strict priority would let a steady
+// stream of interactive work starve the background lanes, so every lane_share-th pop starts at a lower lane,
+// each one in turn: while it has tasks a lane gets at least 1 / (3 * lane_share) of every worker's pops.
+// Workers have fixed slots (deque, counters, CPU) up to thread_count. A lazy pool starts a worker in a free slot when
+// a push finds no worker to wake and more queued tasks than spinning workers, so a burst pays for thread creation
+// once. With an idle_timeout a sleeping worker exits and gives its stack back; its task memory cache is adopted
+// by the next worker. prewarm() starts workers ahead of the first burst
+class thread_pool
+{
+    using local_queue = work_stealing_deque<unique_task*>;
+
+    std::atomic<bool> done{ false }; // Changed under queue_mutex only, read without it by spinning workers
+    thread_pool_options const options;
+    std::vector<unsigned> const cores; // CPU of every worker slot (wrapping around), empty: not pinned
+    unsigned wake_signals = 0; // Guarded by queue_mutex. Pushed tasks waiting for a sleeping worker
+    std::atomic<unsigned> sleepers{ 0 }; // Changed under queue_mutex only
+    std::atomic<unsigned> pushing{ 0 }; // Threads between the start of a push and the end of its wake-up
+    std::mutex queue_mutex; // Only for sleeping and waking, never taken to push or pop a task
+    std::condition_variable queue_cond;
+    mpmc_queue<unique_task> pool_work_queue[3]; // Indexed by task_priority
+
+    struct timed_task
+    {
+        std::chrono::steady_clock::time_point deadline;
+        std::uint64_t order; // Equal deadlines run in submission order
+        unique_task task;
+        bool operator<(timed_task const& other) const noexcept // Later is less urgent: the heap keeps the earliest on top
+        {
+            return deadline != other.deadline ? deadline > other.deadline : order > other.order;
+        }
+    };
+    std::mutex timed_mutex; // Held only for a heap push or pop
+    std::vector<timed_task> timed_tasks; // Heap, guarded by timed_mutex
+    std::uint64_t timed_order = 0; // Guarded by timed_mutex
+    std::atomic<std::size_t> timed_count{ 0 }; // Lets the idle checks skip the lock
+    thread_cache_resource task_memory; // Subtask nodes, and anything tasks allocate through task_resource()
+    std::vector<std::unique_ptr<local_queue>> queues; // One per worker slot, created before the workers start
+    std::atomic<unsigned> live{ 0 }; // Started workers that haven't timed out
+    std::atomic<unsigned> spinning{ 0 }; // Idle workers polling instead of sleeping: they find a push by themselves
+    std::mutex grow_mutex; // Held while starting workers, never by a worker that exits
+    std::vector<std::atomic<bool>> running; // Per slot: a worker owns it. Cleared by the worker as it exits
+
+    // Always on. Written with relaxed increments to a line owned by one thread, so they cost a few ns per task
+    struct worker_counters
+    {
+        std::atomic<std::uint64_t> tasks_run{ 0 };
+        std::atomic<std::uint64_t> steals{ 0 };
+        std::atomic<std::uint64_t> failed_steals{ 0 };
+        std::atomic<std::int64_t> idle_ns{ 0 };
+        std::atomic<std::uint64_t> sampled_tasks{ 0 };
+        std::atomic<std::int64_t> wait_ns{ 0 };
+        std::atomic<std::int64_t> max_wait_ns{ 0 };
+        std::atomic<std::size_t> max_queue_depth{ 0 };
+    };
+    per_thread_slots<worker_counters> counters; // One per worker, plus one shared by the threads outside the pool
+    std::vector<native_thread> threads; // Per slot. Declared last, so threads are joined before the queues are destroyed
+
+    static inline thread_local thread_pool* current_pool = nullptr; // Pool owning the current worker thread
+    static inline thread_local unsigned my_index = 0;
+    static inline thread_local unsigned tasks_submitted = 0; // By the current thread, to any pool
+    static inline thread_local unsigned lane_pops = 0; // Pool queue pops by the current thread, for lane_share
+    static constexpr unsigned lane_count = 4; // Scan order: high, timed, normal, low
+    static inline thread_local unsigned nesting = 0; // run_pending_task() calls on the current thread's stack
+    static constexpr unsigned max_nesting = 16;
+    static constexpr unsigned wait_sample_period = 64;
+
+    worker_counters& my_counters() noexcept
+    {
+        return counters[current_pool == this ? my_index : queues.size()];
+    }
+    static void store_max(std::atomic<std::int64_t>& max, std::int64_t value) noexcept
+    {
+        for (std::int64_t old = max.load(std::memory_order_relaxed); value > old && !max.compare_exchange_weak(old, value, std::memory_order_relaxed);)
+        {
+        }
+    }
+    // Timing every task would cost two clock reads and an allocation. A sampled task is wrapped (it doesn't fit
+    // inline any more) and measures the time from its push until a thread starts it
+    unique_task sample_wait(unique_task task, std::size_t depth)
+    {
+        worker_counters& c = my_counters();
+        if (depth > c.max_queue_depth.load(std::memory_order_relaxed))
+        {
+            c.max_queue_depth.store(depth, std::memory_order_relaxed); // Racy max for the shared slot, fine for a sample
+        }
+        return unique_task([this, task = std::move(task), queued = std::chrono::steady_clock::now()]() mutable
+        {
+            std::int64_t const waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - queued).count();
+            worker_counters& runner = my_counters();
+            runner.sampled_tasks.fetch_add(1, std::memory_order_relaxed);
+            runner.wait_ns.fetch_add(waited, std::memory_order_relaxed);
+            store_max(runner.max_wait_ns, waited);
+            task();
+        });
+    }
+
+    // Deque slots must be trivially copyable, so a subtask is moved into a node. Nodes come from the pushing
+    // worker's cache, a stolen one goes back to it through the cross-thread return path
+    unique_task* new_node(unique_task task)
+    {
+        void* const mem = task_memory.allocate(sizeof(unique_task), alignof(unique_task));
+        return ::new (mem) unique_task(std::move(task));
+    }
+    void take_node(unique_task* p, unique_task& task) noexcept
+    {
+        task = std::move(*p);
+        p->~unique_task();
+        task_memory.deallocate(p, sizeof(unique_task), alignof(unique_task));
+    }
+    bool pop_task_from_local_queue(unique_task& task)
+    {
+        unique_task* p;
+        if (current_pool != this || !queues[my_index]->pop(p))
+        {
+            return false;
+        }
+        take_node(p, task);
+        return true;
+    }
+    bool pop_timed_task(unique_task& task)
+    {
+        if (timed_count.load(std::memory_order_seq_cst) == 0)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lk(timed_mutex);
+        if (timed_tasks.empty())
+        {
+            return false;
+        }
+        std::pop_heap(timed_tasks.begin(), timed_tasks.end());
+        task = std::move(timed_tasks.back().task);
+        timed_tasks.pop_back();
+        timed_count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    bool pop_task_from_lane(unsigned lane, unique_task& task)
+    {
+        switch (lane)
+        {
+        case 0: return pool_work_queue[static_cast<int>(task_priority::high)].try_pop(task);
+        case 1: return pop_timed_task(task);
+        case 2: return pool_work_queue[static_cast<int>(task_priority::normal)].try_pop(task);
+        default: return pool_work_queue[static_cast<int>(task_priority::low)].try_pop(task);
+        }
+    }
+    bool pop_task_from_pool_queue(unique_task& task)
+    {
+        unsigned first = 0;
+        if (options.lane_share != 0 && ++lane_pops % options.lane_share == 0)
+        {
+            first = 1 + lane_pops / options.lane_share % (lane_count - 1); // Starvation protection: timed, normal, low in turn
+        }
+        for (unsigned i = 0; i < lane_count; i++)
+        {
+            if (pop_task_from_lane((first + i) % lane_count, task))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    // A worker tries the other deques, starting after its own. A thread outside the pool tries them all, and
+    // doesn't count its failures: its waits poll all the time, and all of them would write the same counters line
+    bool pop_task_from_other_thread_queue(unique_task& task)
+    {
+        bool const worker = current_pool == this;
+        unsigned const start = worker ? my_index + 1 : 0;
+        std::size_t const victims = worker ? queues.size() - 1 : queues.size();
+        for (std::size_t i = 0; i < victims; i++)
+        {
+            unique_task* p;
+            if (queues[(start + i) % queues.size()]->steal(p))
+            {
+                take_node(p, task);
+                my_counters().steals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            if (worker)
+            {
+                counters[my_index].failed_steals.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+    bool try_run_task(bool steal = true)
+    {
+        unique_task task;
+        if (pop_task_from_local_queue(task) || pop_task_from_pool_queue(task) || (steal && pop_task_from_other_thread_queue(task)))
+        {
+            my_counters().tasks_run.fetch_add(1, std::memory_order_relaxed);
+            task(); // Exceptions are stored in the task's future
+            return true;
+        }
+        return false;
+    }
+    bool local_queues_empty() const noexcept
+    {
+        for (auto const& q : queues)
+        {
+            if (!q->empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool pool_queue_empty() const noexcept
+    {
+        for (auto const& q : pool_work_queue)
+        {
+            if (!q.empty())
+            {
+                return false;
+            }
+        }
+        return timed_count.load(std::memory_order_seq_cst) == 0;
+    }
+    bool has_work() const noexcept
+    {
+        return !pool_queue_empty() || !local_queues_empty();
+    }
+    // Before sleeping, according to options.idle. Returns true if work has shown up. A spinning worker isn't
+    // counted in sleepers, so a push doesn't take the lock or notify for it
+    bool spin_for_work() const noexcept
+    {
+        if (options.idle == idle_policy::park)
+        {
+            return false;
+        }
+        unsigned pause = 1;
+        for (unsigned i = 0; options.idle == idle_policy::spin || i < options.spin_polls; i++)
+        {
+            if (has_work())
+            {
+                return true;
+            }
+            if (done.load(std::memory_order_relaxed))
+            {
+                return false; // Let the worker exit through the sleeping path
+            }
+            for (unsigned j = 0; j < pause; j++)
+            {
+                cpu_relax();
+            }
+            pause = std::min(pause * 2, std::max(options.max_pause, 1u)); // Exponential backoff, less polling traffic
+        }
+        if (options.idle == idle_policy::spin_then_yield)
+        {
+            for (unsigned i = 0; i < options.yield_polls; i++)
+            {
+                if (has_work())
+                {
+                    return true;
+                }
+                std::this_thread::yield();
+            }
+        }
+        return false;
+    }
+    // A timed-out worker leaves unless that would take the pool below min_threads
+    bool retire() noexcept
+    {
+        for (unsigned n = live.load(std::memory_order_seq_cst); n > options.min_threads;)
+        {
+            if (live.compare_exchange_weak(n, n - 1, std::memory_order_seq_cst))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    void worker_thread(unsigned index, std::size_t stack_bytes, std::latch* ready)
+    {
+        current_pool = this;
+        my_index = index;
+        stack_bytes = std::min(stack_bytes, touchable_stack_bytes()); // More would run into the guard page
+        if (stack_bytes != 0)
+        {
+            touch_stack(stack_bytes);
+        }
+        if (ready)
+        {
+            ready->count_down(); // Attributes are applied by native_thread before this function runs
+        }
+        for (;;)
+        {
+            if (try_run_task())
+            {
+                continue;
+            }
+            if (options.idle != idle_policy::park)
+            {
+                auto const idle_start = std::chrono::steady_clock::now();
+                spinning.fetch_add(1, std::memory_order_seq_cst);
+                bool const found = spin_for_work();
+                spinning.fetch_sub(1, std::memory_order_seq_cst); // Before sleepers is raised, the pre-sleep check sees a push that counted it
+                counters[index].idle_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - idle_start).count(), std::memory_order_relaxed);
+                if (found)
+                {
+                    continue;
+                }
+            }
+            std::unique_lock<std::mutex> lk(queue_mutex);
+            if (done && pool_queue_empty())
+            {
+                return; // Own deque is empty, tasks still running push their subtasks to their own deques
+            }
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            // Checked after announcing the sleep, so a concurrent push either is seen here or sees the sleeper
+            bool timed_out = false;
+            if (!done && pool_queue_empty() && local_queues_empty())
+            {
+                auto const idle_start = std::chrono::steady_clock::now();
+                auto const woken = [this] { return done || wake_signals != 0; };
+                if (options.idle_timeout.count() == 0)
+                {
+                    queue_cond.wait(lk, woken);
+                }
+                else
+                {
+                    timed_out = !queue_cond.wait_for(lk, options.idle_timeout, woken);
+                }
+                counters[index].idle_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - idle_start).count(), std::memory_order_relaxed);
+            }
+            // No wake signal was given to this worker, so no push is counting on it. A push it doesn't see here
+            // sees it gone: live is lowered before sleepers, and below the cap the push starts a worker
+            if (timed_out && pool_queue_empty() && local_queues_empty() && retire())
+            {
+                sleepers.fetch_sub(1, std::memory_order_seq_cst);
+                running[index].store(false, std::memory_order_release); // The next worker of the slot joins this thread
+                return;
+            }
+            if (wake_signals != 0)
+            {
+                --wake_signals;
+            }
+            sleepers.fetch_sub(1, std::memory_order_seq_cst);
+        }
+    }
+    // Wakes min(count, sleeping workers) workers with one lock. Returns the number woken
+    std::size_t wake_workers(std::size_t count)
+    {
+        if (count == 0 || sleepers.load(std::memory_order_seq_cst) == 0) // Common case under load: no lock, no syscall
+        {
+            return 0;
+        }
+        std::size_t woken;
+        bool all;
+        {
+            std::lock_guard<std::mutex> lk(queue_mutex);
+            unsigned const asleep = sleepers.load(std::memory_order_relaxed);
+            woken = std::min<std::size_t>(count, asleep > wake_signals ? asleep - wake_signals : 0);
+            wake_signals += static_cast<unsigned>(woken);
+            all = wake_signals == asleep;
+        }
+        if (all && woken > 1)
+        {
+            queue_cond.notify_all();
+        }
+        else
+        {
+            for (std::size_t i = 0; i < woken; i++)
+            {
+                queue_cond.notify_one();
+            }
+        }
+        return woken;
+    }
+    // Holding grow_mutex, with live below the cap. A retiring worker lowers live before it gives its slot back,
+    // so every slot may still be taken for a moment: the scan starts again until that worker has released it
+    void start_worker(std::size_t stack_bytes, std::latch* ready)
+    {
+        unsigned index = 0;
+        for (;;)
+        {
+            while (index < running.size() && running[index].load(std::memory_order_acquire))
+            {
+                ++index;
+            }
+            if (index < running.size())
+            {
+                break;
+            }
+            index = 0;
+            std::this_thread::yield(); // The retiring worker only has to clear its flag, it takes no lock for that
+        }
+        thread_attributes attrs = options.worker_attributes;
+        if (!cores.empty())
+        {
+            attrs.cpus = { cores[index % cores.size()] }; // Wraps around if there are more workers than cores
+            attrs.memory = memory_placement::first_touch; // Worker memory from the node of its core
+        }
+        running[index].store(true, std::memory_order_relaxed);
+        live.fetch_add(1, std::memory_order_seq_cst);
+        try
+        {
+            threads[index] = native_thread(attrs, &thread_pool::worker_thread, this, index, stack_bytes, ready); // Joins the exited worker
+        }
+        catch (...)
+        {
+            live.fetch_sub(1, std::memory_order_seq_cst);
+            running[index].store(false, std::memory_order_relaxed);
+            throw;
+        }
+    }
+    // Called by a push that woke nobody. queued: tasks waiting where the push put its own.
+    // Only lazy and shrinking pools get here with live below the cap: other pools pay one load per push
+    void add_worker_if_needed(std::size_t queued) noexcept
+    {
+        if (live.load(std::memory_order_seq_cst) >= queues.size() || queued <= spinning.load(std::memory_order_seq_cst))
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(grow_mutex);
+        if (done || live.load(std::memory_order_seq_cst) >= queues.size())
+        {
+            return;
+        }
+        try
+        {
+            start_worker(0, nullptr);
+        }
+        catch (std::system_error const&) // No thread could be started: the task waits for a running worker or a waiter
+        {
+        }
+    }
+    void wake_one_worker(std::size_t queued)
+    {
+        if (wake_workers(1) == 0)
+        {
+            add_worker_if_needed(queued);
+        }
+    }
+    // A normal task submitted by a worker is a subtask and stays local. A high or low one goes to its lane,
+    // otherwise its priority would be lost when an idle worker steals it
+    void push_task(unique_task task, task_priority priority = task_priority::normal)
+    {
+        pushing.fetch_add(1, std::memory_order_relaxed);
+        mpmc_queue<unique_task>& lane = pool_work_queue[static_cast<int>(priority)];
+        bool const local = current_pool == this && priority == task_priority::normal;
+        if (++tasks_submitted % wait_sample_period == 0)
+        {
+            task = sample_wait(std::move(task), local ? queues[my_index]->size_approx() : lane.size_approx());
+        }
+        if (local)
+        {
+            queues[my_index]->push(new_node(std::move(task)));
+        }
+        else
+        {
+            while (!lane.try_push(std::move(task))) // Full: the producer helps until there is room
+            {
+                run_pending_task();
+            }
+        }
+        wake_one_worker(local ? queues[my_index]->size_approx() : lane.size_approx());
+        pushing.fetch_sub(1, std::memory_order_release); // Last use of the pool by this push
+    }
+    // The timed lane is a heap under a mutex: unlike the other lanes it is sorted, so a push can't be lock-free
+    void push_timed_task(unique_task task, std::chrono::steady_clock::time_point deadline)
+    {
+        pushing.fetch_add(1, std::memory_order_relaxed);
+        if (++tasks_submitted % wait_sample_period == 0)
+        {
+            task = sample_wait(std::move(task), timed_count.load(std::memory_order_relaxed));
+        }
+        {
+            std::lock_guard<std::mutex> lk(timed_mutex);
+            timed_tasks.push_back(timed_task{ deadline, timed_order++, std::move(task) });
+            std::push_heap(timed_tasks.begin(), timed_tasks.end());
+            timed_count.fetch_add(1, std::memory_order_seq_cst); // Before wake_one_worker() reads sleepers
+        }
+        wake_one_worker(timed_count.load(std::memory_order_relaxed));
+        pushing.fetch_sub(1, std::memory_order_release); // Last use of the pool by this push
+    }
+    void stop() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lk(queue_mutex);
+            done = true;
+        }
+        queue_cond.notify_all();
+    }
+public:
+    explicit thread_pool(unsigned thread_count = std::thread::hardware_concurrency()) :
+        thread_pool(thread_pool_options{ thread_count })
+    {}
+    explicit thread_pool(thread_pool_options const& options) :
+        thread_pool(options, options.pin_to_physical_cores ? physical_core_cpus() : std::vector<unsigned>())
+    {}
+private:
+    static unsigned worker_count(thread_pool_options const& options, std::vector<unsigned> const& cores)
+    {
+        unsigned const thread_count = options.thread_count != 0 ? options.thread_count :
+            !cores.empty() ? static_cast<unsigned>(cores.size()) : std::thread::hardware_concurrency();
+        return thread_count != 0 ? thread_count : 2; // hardware_concurrency() may return 0
+    }
+    thread_pool(thread_pool_options const& options_, std::vector<unsigned> cores_) :
+        options(options_),
+        cores(std::move(cores_)),
+        pool_work_queue{ mpmc_queue<unique_task>(options.queue_capacity), mpmc_queue<unique_task>(options.queue_capacity), mpmc_queue<unique_task>(options.queue_capacity) },
+        counters(worker_count(options, cores) + 1)
+    {
+        unsigned const thread_count = worker_count(options, cores);
+        queues.reserve(thread_count);
+        for (unsigned i = 0; i < thread_count; i++)
+        {
+            queues.push_back(std::make_unique<local_queue>());
+        }
+        running = std::vector<std::atomic<bool>>(thread_count);
+        threads.resize(thread_count);
+        unsigned const initial = options.lazy ? std::min(options.min_threads, thread_count) : thread_count;
+        try
+        {
+            std::lock_guard<std::mutex> lk(grow_mutex);
+            for (unsigned i = 0; i < initial; i++)
+            {
+                start_worker(0, nullptr);
+            }
+        }
+        catch (...)
+        {
+            stop(); // Otherwise the started workers wait forever and joining_thread blocks
+            throw;
+        }
+    }
+public:
+    ~thread_pool()
+    {
+        stop(); // Already queued tasks are still run, then workers are joined by joining_thread
+        {
+            std::lock_guard<std::mutex> lk(grow_mutex); // A worker starting another one has finished, the later ones see done
+        }
+        // A thread outside the pool may still be waking a worker for a task that has already run, and whose
+        // completion let the owner destroy the pool (run_blocking posts the resume of the awaiting coroutine)
+        while (pushing.load(std::memory_order_acquire) != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    template<typename Callable, typename ... Args>
+    std::future<std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>> submit(Callable&& func, Args&& ... args)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>;
+        std::packaged_task<result_type()> task(bind_args(std::forward<Callable>(func), std::forward<Args>(args)...));
+        std::future<result_type> res(task.get_future());
+        push_task(std::move(task)); // packaged_task fits in unique_task, only its shared state is allocated
+        return res;
+    }
+    template<typename Callable, typename ... Args>
+    std::future<std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>> submit(task_priority priority, Callable&& func, Args&& ... args)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>;
+        std::packaged_task<result_type()> task(bind_args(std::forward<Callable>(func), std::forward<Args>(args)...));
+        std::future<result_type> res(task.get_future());
+        push_task(std::move(task), priority);
+        return res;
+    }
+    // Timed tasks run earliest deadline first, after the high lane. A missed deadline doesn't cancel the task,
+    // it only makes it the most urgent one
+    template<typename Callable, typename ... Args>
+    std::future<std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>> submit_before(
+        std::chrono::steady_clock::time_point deadline, Callable&& func, Args&& ... args)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>;
+        std::packaged_task<result_type()> task(bind_args(std::forward<Callable>(func), std::forward<Args>(args)...));
+        std::future<result_type> res(task.get_future());
+        push_timed_task(std::move(task), deadline);
+        return res;
+    }
+    // Fire-and-forget, like a detached thread. Without a future nothing is allocated for a small task
+    // An exception escaping the task calls std::terminate
+    template<typename Callable, typename ... Args>
+    void post(Callable&& func, Args&& ... args)
+    {
+        post(task_priority::normal, std::forward<Callable>(func), std::forward<Args>(args)...);
+    }
+    template<typename Callable, typename ... Args>
+    void post(task_priority priority, Callable&& func, Args&& ... args)
+    {
+        // Trivially copyable arguments keep the task trivially copyable: no allocation, no move or destroy calls
+        push_task([task = bind_args(std::forward<Callable>(func), std::forward<Args>(args)...)]() mutable noexcept
+        {
+            task();
+        }, priority);
+    }
+    // Runs fn(*it) for every element of [first, last). All tasks are built first, then claimed in the pool queue
+    // at once (in as many claims as the queue has room for) and min(n, sleeping workers) workers are woken
+    // in one go. The future becomes ready when every call has returned and holds the first exception thrown.
+    // The range must stay valid until then. From a worker too the tasks go to the pool queue, not the local deque
+    template<typename Iterator, typename Fn>
+    std::future<void> submit_bulk(Iterator first, Iterator last, Fn fn)
+    {
+        struct bulk_state
+        {
+            Fn fn;
+            std::atomic<std::size_t> remaining;
+            std::atomic<bool> failed{ false };
+            std::exception_ptr error; // Written by the first failing task, read by the last one
+            std::promise<void> done;
+            bulk_state(Fn&& fn_, std::size_t n) :
+                fn(std::move(fn_)), remaining(n)
+            {}
+            void run(Iterator it) noexcept
+            {
+                try
+                {
+                    fn(*it);
+                }
+                catch (...)
+                {
+                    if (!failed.exchange(true, std::memory_order_relaxed))
+                    {
+                        error = std::current_exception();
+                    }
+                }
+                if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    error ? done.set_exception(error) : done.set_value();
+                    delete this;
+                }
+            }
+        };
+        std::size_t const n = static_cast<std::size_t>(std::distance(first, last));
+        if (n == 0)
+        {
+            std::promise<void> ready;
+            ready.set_value();
+            return ready.get_future();
+        }
+        auto state = std::make_unique<bulk_state>(std::move(fn), n);
+        std::future<void> result = state->done.get_future();
+        std::vector<unique_task> tasks;
+        tasks.reserve(n);
+        for (Iterator it = first; it != last; ++it)
+        {
+            tasks.emplace_back([s = state.get(), it]() noexcept { s->run(it); }); // Trivially copyable for plain iterators
+        }
+        state.release(); // Deleted by the last task
+        pushing.fetch_add(1, std::memory_order_relaxed);
+        for (std::size_t pushed = 0; pushed < n;)
+        {
+            std::size_t const claimed = pool_work_queue[static_cast<int>(task_priority::normal)].try_push_bulk(tasks.data() + pushed, n - pushed);
+            if (wake_workers(claimed) < claimed)
+            {
+                add_worker_if_needed(claimed); // One worker at a time: it runs tasks until the queue is empty
+            }
+            pushed += claimed;
+            if (claimed == 0) // Full: the producer helps until there is room
+            {
+                run_pending_task();
+            }
+        }
+        pushing.fetch_sub(1, std::memory_order_release);
+        return result;
+    }
+    // 9.1.3 A task waiting for its subtasks must not block its worker (all workers could end up waiting)
+    // It runs other pending tasks instead. Returns false if there was nothing to run.
+    // A task run here can wait and run another one in turn. Stolen tasks, and for a thread outside the pool tasks
+    // of the pool queue (its subtasks go there too), could chain like this until the stack runs out. Past
+    // max_nesting levels a worker stops stealing: its own subtasks nest only as deep as the task tree, and it still
+    // takes the pool queue, where a waited-for task might have no other thread to run it. Other threads only yield
+    bool run_pending_task()
+    {
+        bool ran = false;
+        if (nesting < max_nesting || current_pool == this)
+        {
+            ++nesting;
+            ran = try_run_task(nesting <= max_nesting);
+            --nesting;
+        }
+        if (!ran)
+        {
+            std::this_thread::yield();
+            return false;
+        }
+        return true;
+    }
+    std::size_t size() const noexcept // Maximum number of workers, the parallelism to split work for
+    {
+        return queues.size();
+    }
+    bool is_worker_thread() const noexcept // The calling thread is one of this pool's workers
+    {
+        return current_pool == this;
+    }
+    unsigned running_workers() const noexcept
+    {
+        return live.load(std::memory_order_relaxed);
+    }
+    // Starts workers until n are running (at most size()) and returns when each has touched stack_bytes of its
+    // stack (less if its stack is smaller) and is bound to its CPU, so the first burst doesn't pay for thread
+    // creation and page faults. They still exit after idle_timeout like the others. Returns the number of running workers
+    unsigned prewarm(unsigned n, std::size_t stack_bytes = 64 * 1024)
+    {
+        std::unique_lock<std::mutex> lk(grow_mutex);
+        unsigned const target = std::min(n, static_cast<unsigned>(queues.size()));
+        unsigned const current = live.load(std::memory_order_seq_cst);
+        if (done || current >= target)
+        {
+            return current;
+        }
+        unsigned const count = target - current;
+        std::latch ready(count);
+        unsigned started = 0;
+        try
+        {
+            for (; started < count; started++)
+            {
+                start_worker(stack_bytes, &ready);
+            }
+        }
+        catch (...)
+        {
+            ready.count_down(count - started);
+            lk.unlock();
+            ready.wait(); // The latch is on this stack
+            throw;
+        }
+        lk.unlock();
+        ready.wait();
+        return live.load(std::memory_order_relaxed);
+    }
+    // query_thread_stats() of every worker slot, empty for a slot without a running worker. Compare with stats():
+    // idle workers that still get preempted are sharing their cores with other processes
+    std::vector<std::optional<thread_stats>> worker_thread_stats()
+    {
+        std::lock_guard<std::mutex> lk(grow_mutex); // A slot's thread is only replaced under it
+        std::vector<std::optional<thread_stats>> result;
+        result.reserve(threads.size());
+        for (std::size_t i = 0; i < threads.size(); i++)
+        {
+            result.push_back(running[i].load(std::memory_order_acquire) ? query_thread_stats(threads[i]) : std::nullopt);
+        }
+        return result;
+    }
+    // Per-thread memory for objects made and dropped inside tasks, e.g. std::pmr::vector<char> buf(n, pool.task_resource())
+    // Valid as long as the pool. Objects may be freed by any thread
+    std::pmr::memory_resource* task_resource() noexcept
+    {
+        return &task_memory;
+    }
+    // Can be called at any time from any thread. Every value is read separately, so they may not add up exactly
+    thread_pool_stats stats() const
+    {
+        thread_pool_stats result;
+        std::int64_t total_wait_ns = 0;
+        std::int64_t max_wait_ns = 0;
+        for (std::size_t i = 0; i < counters.size(); i++)
+        {
+            worker_counters const& c = counters[i];
+            thread_pool_stats::worker w;
+            w.tasks_run = c.tasks_run.load(std::memory_order_relaxed);
+            w.steals = c.steals.load(std::memory_order_relaxed);
+            w.failed_steals = c.failed_steals.load(std::memory_order_relaxed);
+            w.idle_time = std::chrono::nanoseconds(c.idle_ns.load(std::memory_order_relaxed));
+            w.local_queue_depth = i < queues.size() ? queues[i]->size_approx() : 0;
+            result.workers.push_back(w);
+            result.sampled_tasks += c.sampled_tasks.load(std::memory_order_relaxed);
+            result.max_sampled_queue_depth = std::max(result.max_sampled_queue_depth, c.max_queue_depth.load(std::memory_order_relaxed));
+            total_wait_ns += c.wait_ns.load(std::memory_order_relaxed);
+            max_wait_ns = std::max(max_wait_ns, c.max_wait_ns.load(std::memory_order_relaxed));
+        }
+        result.timed_queue_depth = timed_count.load(std::memory_order_relaxed);
+        result.pool_queue_depth = result.timed_queue_depth;
+        for (auto const& q : pool_work_queue)
+        {
+            result.pool_queue_depth += q.size_approx();
+        }
+        if (result.sampled_tasks != 0)
+        {
+            result.mean_wait_before_start = std::chrono::nanoseconds(total_wait_ns / static_cast<std::int64_t>(result.sampled_tasks));
+        }
+        result.max_wait_before_start = std::chrono::nanoseconds(max_wait_ns);
+        return result;
+    }
+};
+
+// Tasks and their decay-copied arguments are placed in an arena owned by the batch instead of the heap.
+// The arena is a monotonic buffer over memory reserved once; it's reset only after every task of the batch
+// has finished, so no task can see its arguments destroyed (the problem of oops in 2.1.1 and 2.2).
+// Posting is done by one thread. Arguments that own memory (std::string) still allocate it, unless they
+// are std::pmr types using resource(). When the reserved memory runs out, the heap is used for the rest of the batch
+class task_batch
+{
+    thread_pool& pool;
+    std::vector<std::byte> reserved;
+    std::pmr::monotonic_buffer_resource arena;
+    std::mutex m;
+    std::condition_variable finished;
+    std::size_t pending = 0; // Guarded by m
+
+    void task_done() noexcept
+    {
+        std::lock_guard<std::mutex> lk(m); // Notify under the lock, wait() can destroy the batch right after
+        if (--pending == 0)
+        {
+            finished.notify_all();
+        }
+    }
+public:
+    explicit task_batch(thread_pool& pool_, std::size_t reserved_bytes = 64 * 1024) :
+        pool(pool_), reserved(reserved_bytes), arena(reserved.data(), reserved.size())
+    {}
+    ~task_batch()
+    {
+        wait(); // Like joining_thread: the arena never goes away under a running task
+    }
+    task_batch(const task_batch&) = delete;
+    task_batch& operator=(const task_batch&) = delete;
+
+    // Same arguments as the std::thread constructor. An exception escaping the task calls std::terminate
+    template<typename Callable, typename ... Args>
+    void post(Callable&& func, Args&& ... args)
+    {
+        auto task = bind_args(std::forward<Callable>(func), std::forward<Args>(args)...);
+        using task_type = decltype(task);
+        task_type* const p = ::new (arena.allocate(sizeof(task_type), alignof(task_type))) task_type(std::move(task));
+        {
+            std::lock_guard<std::mutex> lk(m);
+            ++pending;
+        }
+        pool.post([this, p]() noexcept
+        {
+            (*p)();
+            p->~task_type(); // Memory is given back by the arena reset in wait()
+            task_done();
+        });
+    }
+    // Waits for all posted tasks (running other pool tasks meanwhile) and resets the arena for the next batch
+    void wait()
+    {
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lk(m);
+                if (pending == 0)
+                {
+                    break;
+                }
+            }
+            if (!pool.run_pending_task())
+            {
+                std::unique_lock<std::mutex> lk(m);
+                finished.wait(lk, [this] { return pending == 0; }); // Everything left is already running
+            }
+        }
+        arena.release();
+    }
+    std::pmr::memory_resource* resource() noexcept
+    {
+        return &arena;
+    }
+};
+
+// Listing 2.8 on the pool: workers are started once and reused for every do_work
+void do_work(unsigned id);
+void pool_f(thread_pool& pool)
+{
+    std::vector<std::future<void>> results;
+    for (unsigned i = 0; i < 20; i++)
+    {
+        results.push_back(pool.submit(do_work, i));
+    }
+    for (auto& result : results)
+    {
+        result.get(); // Rethrows an exception thrown by do_work
+    }
+}
+
+// The same with one submission: one queue claim, one round of wakeups and one future for the whole batch
+void pool_f_bulk(thread_pool& pool)
+{
+    std::vector<unsigned> ids(20);
+    std::iota(ids.begin(), ids.end(), 0u);
+    pool.submit_bulk(ids.begin(), ids.end(), do_work).get(); // Rethrows the first exception thrown by do_work
+}
+
+// Divide and conquer on the pool. The upper half is a subtask on the local deque of the current worker,
+// it's stolen only if another worker is idle. While waiting for it, the current thread runs other tasks
+template<typename Iterator, typename T>
+T pool_accumulate(thread_pool& pool, Iterator first, Iterator last, T init)
+{
+    auto const length = std::distance(first, last);
+    if (length <= 10000)
+    {
+        return std::accumulate(first, last, init);
+    }
+    Iterator const mid = std::next(first, length / 2);
+    std::future<T> upper = pool.submit([&pool, mid, last] { return pool_accumulate(pool, mid, last, T()); });
+    T const lower = pool_accumulate(pool, first, mid, init);
+    while (upper.wait_for(std::chrono::seconds(0)) == std::future_status::timeout)
+    {
+        pool.run_pending_task();
+    }
+    return lower + upper.get();
+}
+
+// High-rate spawner: one arena per batch instead of a heap allocation per launch
+void process_ids(thread_pool& pool, std::vector<unsigned> const& ids)
+{
+    task_batch batch(pool, ids.size() * 64);
+    for (unsigned id : ids)
+    {
+        batch.post(do_work, id);
+    }
+} // Waits for every do_work, then the arena is freed
+
+
+
+
+
+/**********************************************/
+/* 9.1.6 Bounded executor for background work */
+/**********************************************/
+// What to do with a task when the submission queue is full
+enum class overflow_policy
+{
+    block, // Wait until the queue has room
+    reject, // submit() returns false
+    run_inline // Run the task in the submitting thread
+};
+
+// Replaces detached threads. At most max_threads workers are started (on demand) and at most
+// queue_capacity tasks wait for them. Tasks are fire-and-forget like detached threads,
+// an exception escaping a task calls std::terminate, as it would in a std::thread.
+// Submitting and taking a task are lock-free, the mutex is only used to sleep, wake and start workers
+class background_executor
+{
+    static constexpr std::size_t stopped_bit = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+
+    std::size_t const max_threads;
+    std::size_t const limit; // Running plus waiting tasks
+    overflow_policy const policy;
+    thread_attributes const attrs; // Of every worker
+    std::atomic<std::size_t> in_flight{ 0 }; // Reserved (queued or running) tasks, with stopped_bit after shutdown()
+    mpmc_queue<unique_task> work_queue; // Never full, a place is reserved in in_flight before pushing
+    std::atomic<std::size_t> sleepers{ 0 }; // Changed under m only
+    std::atomic<std::size_t> blocked_producers{ 0 }; // Changed under m only
+    std::atomic<std::size_t> started_threads{ 0 };
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::size_t wake_signals = 0; // Guarded by m
+    std::vector<native_thread> threads; // Guarded by m
+
+    static bool drained(std::size_t n) noexcept // Stopped and nothing queued or running
+    {
+        return n == stopped_bit;
+    }
+    // Reserves a place for one task. Fails if the executor is full or stopped
+    bool try_reserve(std::size_t& reserved) noexcept
+    {
+        std::size_t n = in_flight.load(std::memory_order_relaxed);
+        do
+        {
+            if ((n & stopped_bit) || n >= limit)
+            {
+                return false;
+            }
+        } while (!in_flight.compare_exchange_weak(n, n + 1, std::memory_order_seq_cst, std::memory_order_relaxed));
+        reserved = n + 1;
+        return true;
+    }
+    bool stopped() const noexcept
+    {
+        return in_flight.load(std::memory_order_relaxed) & stopped_bit;
+    }
+    void wait_for_room()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        blocked_producers.fetch_add(1, std::memory_order_seq_cst);
+        not_full.wait(lk, [this]
+        {
+            std::size_t const n = in_flight.load(std::memory_order_seq_cst);
+            return (n & stopped_bit) || n < limit;
+        });
+        blocked_producers.fetch_sub(1, std::memory_order_relaxed);
+    }
+    void task_finished()
+    {
+        std::size_t const n = in_flight.fetch_sub(1, std::memory_order_seq_cst) - 1;
+        if (drained(n)) // The last task after shutdown(), let every worker exit
+        {
+            std::lock_guard<std::mutex> lk(m);
+            not_empty.notify_all();
+        }
+        if (blocked_producers.load(std::memory_order_seq_cst) != 0)
+        {
+            std::lock_guard<std::mutex> lk(m);
+            not_full.notify_one();
+        }
+    }
+    // Every queued task needs a signalled sleeper: the missing signals are given to sleepers that have none yet,
+    // and if there are still more queued tasks than signals a new worker is started. Counting running workers
+    // instead would leave a task behind tasks that never end (the editing loops of document_executor)
+    void wake_or_start_worker()
+    {
+        if (sleepers.load(std::memory_order_seq_cst) == 0 && started_threads.load(std::memory_order_relaxed) >= max_threads)
+        {
+            return; // Common case under load: every worker is busy and no more can be started
+        }
+        std::size_t signals = 0;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            std::size_t const queued = work_queue.size_approx();
+            std::size_t const asleep = sleepers.load(std::memory_order_relaxed);
+            std::size_t const unsignalled = asleep > wake_signals ? asleep - wake_signals : 0;
+            std::size_t const missing = queued > wake_signals ? queued - wake_signals : 0;
+            signals = std::min(missing, unsignalled);
+            wake_signals += signals;
+            if (missing > signals && threads.size() < max_threads)
+            {
+                threads.emplace_back(attrs, &background_executor::worker_thread, this);
+                started_threads.store(threads.size(), std::memory_order_relaxed);
+            }
+        }
+        if (signals == 1)
+        {
+            not_empty.notify_one();
+        }
+        else if (signals > 1)
+        {
+            not_empty.notify_all(); // Only as many workers as there are signals leave the wait
+        }
+    }
+    void worker_thread()
+    {
+        for (;;)
+        {
+            unique_task task;
+            if (work_queue.try_pop(task))
+            {
+                task();
+                task_finished();
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(m);
+            if (drained(in_flight.load(std::memory_order_seq_cst)))
+            {
+                return;
+            }
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            // Checked after announcing the sleep, so a concurrent submit either is seen here or sees the sleeper
+            if (work_queue.empty())
+            {
+                not_empty.wait(lk, [this] { return wake_signals != 0 || drained(in_flight.load(std::memory_order_seq_cst)); });
+            }
+            if (wake_signals != 0)
+            {
+                --wake_signals;
+            }
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+public:
+    explicit background_executor(std::size_t max_threads_ = std::thread::hardware_concurrency(),
+        std::size_t queue_capacity = 64, overflow_policy policy_ = overflow_policy::block, thread_attributes attrs_ = thread_attributes()) :
+        max_threads(max_threads_ != 0 ? max_threads_ : 2), limit(max_threads + queue_capacity), policy(policy_),
+        attrs(std::move(attrs_)), work_queue(limit)
+    {}
+    ~background_executor()
+    {
+        shutdown();
+    }
+    background_executor(const background_executor&) = delete;
+    background_executor& operator=(const background_executor&) = delete;
+
+    // Same arguments as the std::thread constructor. Returns false if the task was rejected
+    template<typename Callable, typename ... Args>
+    bool submit(Callable&& func, Args&& ... args)
+    {
+        auto task = bind_args(std::forward<Callable>(func), std::forward<Args>(args)...);
+        std::size_t reserved;
+        while (!try_reserve(reserved))
+        {
+            if (stopped())
+            {
+                return false; // No new work after shutdown()
+            }
+            switch (policy)
+            {
+            case overflow_policy::block:
+                wait_for_room();
+                break;
+            case overflow_policy::reject:
+                return false;
+            case overflow_policy::run_inline:
+                task(); // Slows the producer down to the speed of the workers
+                return true;
+            }
+        }
+        // The reservation guarantees room, but not that the slot at the tail is free yet: a worker may still be moving
+        // out the element of one lap ago. That takes a few instructions, so just retry
+        for (unique_task t(std::move(task)); !work_queue.try_push(std::move(t));)
+        {
+            std::this_thread::yield();
+        }
+        wake_or_start_worker();
+        return true;
+    }
+    // Stops accepting tasks, runs the queued ones and joins the workers. Must not be called from a task
+    void shutdown()
+    {
+        in_flight.fetch_or(stopped_bit, std::memory_order_seq_cst);
+        {
+            std::lock_guard<std::mutex> lk(m);
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+        for (;;)
+        {
+            std::vector<native_thread> workers;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                workers.swap(threads);
+                if (workers.empty() && drained(in_flight.load(std::memory_order_seq_cst)))
+                {
+                    return;
+                }
+            }
+            if (workers.empty())
+            {
+                std::this_thread::yield(); // A task reserved before the stop is about to be pushed
+            }
+        } // workers are joined here, after the queue is drained
+    }
+};
+
+// Executor used by edit_document in 2.1.4. A new document is refused rather than queued behind open ones.
+// Its workers reserve 256 KB of stack each instead of the default 8 MB
+background_executor& document_executor()
+{
+    static background_executor executor(16, 0, overflow_policy::reject, []
+    {
+        thread_attributes attrs;
+        attrs.stack_size = 256 * 1024;
+        return attrs;
+    }());
+    return executor;
+}
+
+
+
+
+
+/**********************************************/
+/* 9.1.7 Futures with continuations on a pool */
+/**********************************************/
+
+// std::future can only be waited for, a thread is parked in get() until the value is there.
+// pool_future can have a continuation, which is posted to an executor (anything with post(), like thread_pool)
+// when the value is set. As in the Concurrency TS, the continuation receives the ready future
+template<typename T>
+class pool_future;
+template<typename T>
+class pool_promise;
+
+template<typename T>
+class future_state
+{
+    using stored_type = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+    std::mutex m;
+    std::condition_variable cond;
+    bool ready = false; // Guarded by m
+    std::optional<stored_type> value; // Guarded by m
+    std::exception_ptr error; // Guarded by m
+    unique_task continuation; // Guarded by m. Runs in the thread making the state ready (or attaching it if ready)
+
+    template<typename Store>
+    void make_ready(Store store)
+    {
+        unique_task next;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (ready)
+            {
+                throw std::future_error(std::future_errc::promise_already_satisfied);
+            }
+            store();
+            ready = true;
+            next = std::move(continuation);
+        }
+        cond.notify_all();
+        if (next)
+        {
+            next();
+        }
+    }
+public:
+    template<typename ... V>
+    void set_value(V&& ... v)
+    {
+        make_ready([&] { value.emplace(std::forward<V>(v)...); });
+    }
+    void set_exception(std::exception_ptr e)
+    {
+        make_ready([&] { error = std::move(e); });
+    }
+    void on_ready(unique_task task) // One continuation per state
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (!ready)
+            {
+                continuation = std::move(task);
+                return;
+            }
+        }
+        task();
+    }
+    bool is_ready()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return ready;
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cond.wait(lk, [this] { return ready; });
+    }
+    T get() // Once: the value is moved out
+    {
+        wait();
+        std::lock_guard<std::mutex> lk(m);
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        if constexpr (!std::is_void_v<T>)
+        {
+            return std::move(*value);
+        }
+    }
+};
+
+// Sets p from the result of fn() or from the exception it throws
+template<typename T, typename F>
+void fulfil(pool_promise<T>& p, F&& fn)
+{
+    try
+    {
+        if constexpr (std::is_void_v<T>)
+        {
+            fn();
+            p.set_value();
+        }
+        else
+        {
+            p.set_value(fn());
+        }
+    }
+    catch (...)
+    {
+        p.set_exception(std::current_exception());
+    }
+}
+
+template<typename T>
+class pool_promise
+{
+    std::shared_ptr<future_state<T>> state = std::make_shared<future_state<T>>();
+    bool retrieved = false;
+public:
+    pool_promise() = default;
+    pool_promise(pool_promise&&) noexcept = default;
+    pool_promise& operator=(pool_promise&& other) noexcept
+    {
+        abandon();
+        state = std::move(other.state);
+        retrieved = other.retrieved;
+        return *this;
+    }
+    ~pool_promise()
+    {
+        abandon();
+    }
+    pool_future<T> get_future()
+    {
+        if (retrieved)
+        {
+            throw std::future_error(std::future_errc::future_already_retrieved);
+        }
+        retrieved = true;
+        return pool_future<T>(state);
+    }
+    template<typename ... V>
+    void set_value(V&& ... v)
+    {
+        state->set_value(std::forward<V>(v)...);
+    }
+    void set_exception(std::exception_ptr e)
+    {
+        state->set_exception(std::move(e));
+    }
+private:
+    void abandon() noexcept // Like std::promise: the future gets broken_promise if no value was set
+    {
+        if (state && !state->is_ready())
+        {
+            state->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        }
+    }
+};
+
+template<typename T>
+class pool_future
+{
+    std::shared_ptr<future_state<T>> state;
+
+    template<typename U>
+    friend class pool_promise;
+    template<typename U>
+    friend class pool_future;
+    template<typename U>
+    friend pool_future<std::vector<pool_future<U>>> when_all(std::vector<pool_future<U>> futures);
+    template<typename U>
+    friend struct when_any_state;
+    explicit pool_future(std::shared_ptr<future_state<T>> state_) :
+        state(std::move(state_))
+    {}
+public:
+    pool_future() noexcept = default;
+    bool valid() const noexcept
+    {
+        return state != nullptr;
+    }
+    bool is_ready() const
+    {
+        return state->is_ready();
+    }
+    void wait() const
+    {
+        state->wait();
+    }
+    T get() // Blocks. Rethrows the exception of the task
+    {
+        auto s = std::move(state);
+        return s->get();
+    }
+    // Posts func(ready future) to ex when this future is ready. This future is consumed
+    template<typename Executor, typename F>
+    pool_future<std::invoke_result_t<std::decay_t<F>, pool_future<T>>> then(Executor& ex, F&& func)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<F>, pool_future<T>>;
+        pool_promise<result_type> next;
+        auto result = next.get_future();
+        auto s = std::move(state);
+        auto* const raw = s.get();
+        raw->on_ready([&ex, s = std::move(s), func = std::forward<F>(func), next = std::move(next)]() mutable
+        {
+            ex.post([s = std::move(s), func = std::move(func), next = std::move(next)]() mutable
+            {
+                fulfil(next, [&] { return func(pool_future<T>(std::move(s))); });
+            });
+        });
+        return result;
+    }
+};
+
+// Runs func(args...) on ex and returns its result as a pool_future
+template<typename Executor, typename Callable, typename ... Args>
+pool_future<std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>> async_submit(Executor& ex, Callable&& func, Args&& ... args)
+{
+    using result_type = std::invoke_result_t<std::decay_t<Callable>, std::decay_t<Args>...>;
+    pool_promise<result_type> p;
+    auto result = p.get_future();
+    ex.post([p = std::move(p), func = std::forward<Callable>(func), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+    {
+        fulfil(p, [&] { return std::apply(std::move(func), std::move(args)); });
+    });
+    return result;
+}
+
+// 4.4.6 Waiting for more than one future. Ready when all futures are ready, nobody waits in the meantime:
+// the last future to become ready makes the result ready
+template<typename T>
+pool_future<std::vector<pool_future<T>>> when_all(std::vector<pool_future<T>> futures)
+{
+    struct all_state
+    {
+        std::vector<pool_future<T>> futures;
+        std::atomic<std::size_t> remaining;
+        pool_promise<std::vector<pool_future<T>>> done;
+    };
+    auto all = std::make_shared<all_state>();
+    auto result = all->done.get_future();
+    if (futures.empty())
+    {
+        all->done.set_value();
+        return result;
+    }
+    std::vector<std::shared_ptr<future_state<T>>> states; // The last continuation may move all->futures away during the loop
+    for (auto const& f : futures)
+    {
+        states.push_back(f.state);
+    }
+    all->remaining.store(futures.size(), std::memory_order_relaxed);
+    all->futures = std::move(futures);
+    for (auto const& state : states)
+    {
+        state->on_ready([all]
+        {
+            if (all->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                all->done.set_value(std::move(all->futures));
+            }
+        });
+    }
+    return result;
+}
+
+// 4.4.7 Waiting for the first future in a set. index is the position of the first ready future
+template<typename Sequence>
+struct when_any_result
+{
+    std::size_t index;
+    Sequence futures;
+};
+template<typename T>
+struct when_any_state
+{
+    std::vector<pool_future<T>> futures;
+    std::atomic<bool> fired{ false };
+    pool_promise<when_any_result<std::vector<pool_future<T>>>> done;
+
+    static pool_future<when_any_result<std::vector<pool_future<T>>>> start(std::vector<pool_future<T>> input)
+    {
+        auto any = std::make_shared<when_any_state>();
+        auto result = any->done.get_future();
+        std::vector<std::shared_ptr<future_state<T>>> states; // The first continuation moves any->futures away
+        for (auto const& f : input)
+        {
+            states.push_back(f.state);
+        }
+        any->futures = std::move(input);
+        for (std::size_t i = 0; i < states.size(); i++)
+        {
+            states[i]->on_ready([any, i]
+            {
+                if (!any->fired.exchange(true, std::memory_order_acq_rel))
+                {
+                    any->done.set_value(when_any_result<std::vector<pool_future<T>>>{ i, std::move(any->futures) });
+                }
+            });
+        }
+        return result;
+    }
+};
+template<typename T>
+pool_future<when_any_result<std::vector<pool_future<T>>>> when_any(std::vector<pool_future<T>> futures)
+{
+    return when_any_state<T>::start(std::move(futures));
+}
+
+// Listing 2.8 fan-out/fan-in without a thread blocked in join(): the continuation runs when the last do_work is done
+pool_future<void> do_all_work(thread_pool& pool)
+{
+    std::vector<pool_future<void>> work;
+    for (unsigned i = 0; i < 20; i++)
+    {
+        work.push_back(async_submit(pool, do_work, i));
+    }
+    return when_all(std::move(work)).then(pool, [](pool_future<std::vector<pool_future<void>>> all)
+    {
+        for (auto& f : all.get())
+        {
+            f.get(); // Rethrows the first exception thrown by do_work
+        }
+    });
+}
+
+
+
+
+
+/****************************************/
+/* 9.1.8 Coroutines running on the pool */
+/****************************************/
+
+// A thread blocked on I/O (get_user_input in edit_document) can't run anything else. A coroutine waiting for
+// something is only a suspended frame on the heap: thousands of them can share the few threads of a pool.
+// task<T> is lazy, it starts when it's awaited and resumes its awaiter when it's done (symmetric transfer, so a
+// long chain of tasks doesn't grow the stack). On which thread it runs is decided by what it awaits
+template<typename T = void>
+class task;
+
+template<typename T>
+struct task_promise_base
+{
+    std::coroutine_handle<> continuation; // The awaiting coroutine
+    std::exception_ptr error;
+
+    struct final_awaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+        {
+            std::coroutine_handle<> const next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept
+    {
+        error = std::current_exception(); // Rethrown to the awaiter
+    }
+};
+template<typename T>
+struct task_promise : task_promise_base<T>
+{
+    std::optional<T> value;
+    task<T> get_return_object() noexcept;
+    template<typename U>
+    void return_value(U&& v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+    T result()
+    {
+        if (this->error)
+        {
+            std::rethrow_exception(this->error);
+        }
+        return std::move(*value);
+    }
+};
+template<>
+struct task_promise<void> : task_promise_base<void>
+{
+    task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void result()
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+template<typename T>
+class task
+{
+public:
+    using promise_type = task_promise<T>;
+private:
+    std::coroutine_handle<promise_type> h;
+public:
+    explicit task(std::coroutine_handle<promise_type> h_) noexcept :
+        h(h_)
+    {}
+    task(task&& other) noexcept :
+        h(std::exchange(other.h, nullptr))
+    {}
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h)
+            {
+                h.destroy();
+            }
+            h = std::exchange(other.h, nullptr);
+        }
+        return *this;
+    }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task()
+    {
+        if (h)
+        {
+            h.destroy(); // A task that never ran is destroyed without running
+        }
+    }
+    auto operator co_await() && noexcept // co_await some_task(); or co_await std::move(t);
+    {
+        struct awaiter
+        {
+            std::coroutine_handle<promise_type> h;
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                h.promise().continuation = awaiting;
+                return h; // Starts the task on the current thread
+            }
+            T await_resume()
+            {
+                return h.promise().result();
+            }
+        };
+        return awaiter{ h };
+    }
+};
+template<typename T>
+task<T> task_promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+task<void> task_promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// Started at once and destroyed at its end. Nobody waits for it, like a detached thread
+struct detached_coroutine
+{
+    struct promise_type
+    {
+        detached_coroutine get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept
+        {
+            std::terminate(); // As for an exception escaping a std::thread
+        }
+    };
+};
+// Fire-and-forget. Usually the task starts with co_await schedule_on(pool), so it doesn't run here
+void spawn_detached(task<> t)
+{
+    [](task<> t) -> detached_coroutine
+    {
+        co_await std::move(t);
+    }(std::move(t));
+}
+// Runs t and blocks the calling thread until it's done. The bridge from ordinary code, e.g. from main()
+template<typename T>
+T sync_wait(task<T> t)
+{
+    std::promise<T> p;
+    std::future<T> f = p.get_future();
+    [](task<T> t, std::promise<T> p) -> detached_coroutine // The promise lives in the frame, not on this stack
+    {
+        try
+        {
+            if constexpr (std::is_void_v<T>)
+            {
+                co_await std::move(t);
+                p.set_value();
+            }
+            else
+            {
+                p.set_value(co_await std::move(t));
+            }
+        }
+        catch (...)
+        {
+            p.set_exception(std::current_exception());
+        }
+    }(std::move(t), std::move(p));
+    return f.get();
+}
+
+// co_await schedule_on(pool); continues the coroutine on a pool worker
+struct schedule_on
+{
+    thread_pool& pool;
+    task_priority priority = task_priority::normal;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        pool.post(priority, [h] { h.resume(); }); // A coroutine_handle is trivially copyable, the task is stored inline
+    }
+    void await_resume() const noexcept {}
+};
+
+// Blocking calls (file and console I/O, join) run on a separate executor, so no pool worker is tied up.
+// Its threads only block, they're started on demand and they don't compete with the pool for the cores
+background_executor& blocking_executor()
+{
+    static background_executor executor(64, 1024, overflow_policy::block);
+    return executor;
+}
+// co_await run_blocking(pool, f, args...) runs f on the blocking executor and returns its result,
+// continuing on the pool. An exception thrown by f is rethrown at the co_await
+template<typename Callable, typename ... Args>
+auto run_blocking(thread_pool& pool, Callable&& func, Args&& ... args)
+{
+    using call_type = decltype(bind_args(std::forward<Callable>(func), std::forward<Args>(args)...));
+    using result_type = std::invoke_result_t<call_type&>;
+    using stored_type = std::conditional_t<std::is_void_v<result_type>, std::monostate, result_type>;
+    struct awaiter
+    {
+        thread_pool& pool;
+        call_type call;
+        std::optional<stored_type> result;
+        std::exception_ptr error;
+
+        void run() noexcept
+        {
+            try
+            {
+                if constexpr (std::is_void_v<result_type>)
+                {
+                    call();
+                    result.emplace();
+                }
+                else
+                {
+                    result.emplace(call());
+                }
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            bool const submitted = blocking_executor().submit([this, h]
+            {
+                run();
+                thread_pool& p = pool;
+                p.post([h] { h.resume(); }); // The awaiter may be gone from here on
+            });
+            if (!submitted) // Executor already shut down (program exit), run it here
+            {
+                run();
+            }
+            return submitted; // The awaiter must not be touched after a successful submit
+        }
+        result_type await_resume()
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            if constexpr (!std::is_void_v<result_type>)
+            {
+                return std::move(*result);
+            }
+        }
+    };
+    return awaiter{ pool, bind_args(std::forward<Callable>(func), std::forward<Args>(args)...), std::nullopt, nullptr };
+}
+// co_await async_join(t, pool); waits for the thread to finish without blocking a pool worker
+auto async_join(joining_thread& t, thread_pool& pool)
+{
+    return run_blocking(pool, [&t] { t.join(); });
+}
+
+// edit_document of 2.1.4 as a coroutine. While the user types, the document is only a suspended frame,
+// so opening another document doesn't cost a thread
+task<> edit_document_async(thread_pool& pool, std::string filename)
+{
+    co_await schedule_on{ pool, task_priority::low }; // Opening a document is background work
+    co_await run_blocking(pool, [&filename] { open_document_and_display_gui(filename); });
+    while (!done_editing())
+    {
+        user_command cmd = co_await run_blocking(pool, get_user_input);
+        if (cmd.type == open_new_document)
+        {
+            std::string new_name = co_await run_blocking(pool, get_filename_from_user);
+            spawn_detached(edit_document_async(pool, std::move(new_name)));
+        }
+        else
+        {
+            co_await schedule_on{ pool, task_priority::high }; // Ahead of the tasks of documents being loaded
+            process_user_input(cmd);
+        }
+    }
+}
+
+
+
+
+
+/**********************************************************/
+/* 10.1 Parallel for_each, transform and transform_reduce */
+/**********************************************************/
+
+// Pool shared by the parallel algorithms, so a call doesn't start threads. Workers start on first use
+thread_pool& default_pool()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+// Waits for a task of pool. A worker (or any thread) waiting this way runs other tasks meanwhile (see 9.1.3).
+// A thread outside the pool that keeps finding nothing to run blocks on f for a while instead of polling.
+// A worker doesn't: the task may be on its own deque, and only the worker itself pops from there
+template<typename T>
+void wait_running_tasks(thread_pool& pool, std::future<T> const& f)
+{
+    unsigned empty_polls = 0;
+    while (f.wait_for(std::chrono::seconds(0)) == std::future_status::timeout)
+    {
+        if (pool.run_pending_task())
+        {
+            empty_polls = 0;
+        }
+        else if (++empty_polls >= 16 && !pool.is_worker_thread())
+        {
+            f.wait_for(std::chrono::milliseconds(1)); // Then polls again, for tasks pushed meanwhile
+        }
+    }
+}
+
+// How a range is cut into blocks
+struct static_partitioner // The heuristic of parallel_accumulate: a fixed minimum, one block per pool worker at most
+{
+    std::size_t min_per_block = 25;
+};
+// The calling thread first runs chunks of 1, 2, 4... elements until sample_time has passed. A range finished by
+// then stays serial. The rest is cut into chunks expected to take target_chunk_time each (long enough to hide the
+// cost of a task), and the caller and pool workers take chunks one by one, so expensive parts of a range are balanced
+struct auto_partitioner
+{
+    std::chrono::nanoseconds sample_time = std::chrono::microseconds(20);
+    std::chrono::nanoseconds target_chunk_time = std::chrono::microseconds(100);
+};
+
+// Calls block(begin, end) for blocks covering [0, length). All blocks but the last run on the pool,
+// the last one in the calling thread.
+// Returns the block results in order. If blocks throw, all blocks are finished before the first exception is rethrown
+template<typename Block>
+auto run_blocks(thread_pool& pool, std::size_t length, static_partitioner partitioner, Block block)
+{
+    using result_type = std::invoke_result_t<Block&, std::size_t, std::size_t>;
+    std::size_t const num_blocks = length != 0 ? choose_num_threads(length, partitioner.min_per_block, pool.size()) : 1;
+    std::vector<std::future<result_type>> pending;
+    pending.reserve(num_blocks - 1);
+    for (std::size_t i = 0; i + 1 < num_blocks; i++)
+    {
+        pending.push_back(pool.submit(std::ref(block), i * length / num_blocks, (i + 1) * length / num_blocks));
+    }
+    auto finish = [&]
+    {
+        for (auto& f : pending)
+        {
+            wait_running_tasks(pool, f); // No get() yet, every block must be done before the range can go away
+        }
+    };
+    if constexpr (std::is_void_v<result_type>)
+    {
+        try
+        {
+            block((num_blocks - 1) * length / num_blocks, length);
+        }
+        catch (...)
+        {
+            finish();
+            throw;
+        }
+        finish();
+        for (auto& f : pending)
+        {
+            f.get();
+        }
+    }
+    else
+    {
+        std::optional<result_type> last_result;
+        try
+        {
+            last_result.emplace(block((num_blocks - 1) * length / num_blocks, length));
+        }
+        catch (...)
+        {
+            finish();
+            throw;
+        }
+        finish();
+        std::vector<result_type> results;
+        results.reserve(num_blocks);
+        for (auto& f : pending)
+        {
+            results.push_back(f.get());
+        }
+        results.push_back(std::move(*last_result));
+        return results;
+    }
+}
+
+// Same as above with the blocks chosen by measuring block(). Results are still returned in range order
+template<typename Block>
+auto run_blocks(thread_pool& pool, std::size_t length, auto_partitioner partitioner, Block block)
+{
+    using block_result = std::invoke_result_t<Block&, std::size_t, std::size_t>;
+    using result_type = std::conditional_t<std::is_void_v<block_result>, std::monostate, block_result>;
+    auto const run = [&block](std::size_t begin, std::size_t end) -> result_type
+    {
+        if constexpr (std::is_void_v<block_result>)
+        {
+            block(begin, end);
+            return {};
+        }
+        else
+        {
+            return block(begin, end);
+        }
+    };
+    std::vector<result_type> results;
+    // Sampling in the calling thread
+    std::size_t done = 0;
+    auto const start = std::chrono::steady_clock::now();
+    for (std::size_t chunk = 1; done < length; chunk *= 2)
+    {
+        std::size_t const end = std::min(length, done + chunk);
+        results.push_back(run(done, end));
+        done = end;
+        if (std::chrono::steady_clock::now() - start >= partitioner.sample_time)
+        {
+            break;
+        }
+    }
+    if (done < length)
+    {
+        double const ns_per_element = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / done;
+        double const elements_per_chunk = std::chrono::duration<double, std::nano>(partitioner.target_chunk_time).count() / ns_per_element;
+        std::size_t const remaining = length - done;
+        std::size_t const grain = static_cast<std::size_t>(std::clamp(elements_per_chunk, 1.0, static_cast<double>(remaining)));
+        std::size_t const num_chunks = (remaining + grain - 1) / grain;
+        std::vector<std::optional<result_type>> chunk_results(num_chunks); // Written once per chunk, too rarely for false sharing to matter
+        std::atomic<std::size_t> next_chunk{ 0 };
+        auto const take_chunks = [&]
+        {
+            try
+            {
+                for (std::size_t c; (c = next_chunk.fetch_add(1, std::memory_order_relaxed)) < num_chunks;)
+                {
+                    std::size_t const begin = done + c * grain;
+                    chunk_results[c].emplace(run(begin, std::min(length, begin + grain)));
+                }
+            }
+            catch (...)
+            {
+                next_chunk.store(num_chunks, std::memory_order_relaxed); // Nobody starts another chunk
+                throw;
+            }
+        };
+        // Helpers are ordinary pool tasks: one that starts after all chunks are taken returns at once
+        std::vector<std::future<void>> helpers;
+        std::size_t const num_helpers = std::min<std::size_t>(pool.size(), num_chunks) - 1;
+        for (std::size_t i = 0; i < num_helpers; i++)
+        {
+            helpers.push_back(pool.submit(std::ref(take_chunks)));
+        }
+        auto const finish = [&]
+        {
+            for (auto& f : helpers)
+            {
+                wait_running_tasks(pool, f);
+            }
+        };
+        try
+        {
+            take_chunks();
+        }
+        catch (...)
+        {
+            finish();
+            throw;
+        }
+        finish();
+        for (auto& f : helpers)
+        {
+            f.get();
+        }
+        for (std::size_t c = 0; c < num_chunks; c++)
+        {
+            results.push_back(std::move(*chunk_results[c]));
+        }
+    }
+    if constexpr (!std::is_void_v<block_result>)
+    {
+        return results;
+    }
+}
+
+// Random-access iterators only: blocks are found in constant time, without walking the range.
+// Ranges are split by auto_partitioner unless a static_partitioner is passed
+template<typename RandomIt, typename Function, typename Partitioner = auto_partitioner>
+void parallel_for_each(thread_pool& pool, RandomIt first, RandomIt last, Function f, Partitioner partitioner = Partitioner())
+{
+    run_blocks(pool, static_cast<std::size_t>(last - first), partitioner, [first, &f](std::size_t begin, std::size_t end)
+    {
+        std::for_each(first + begin, first + end, f);
+    });
+}
+template<typename RandomIt, typename Function, typename Partitioner = auto_partitioner>
+void parallel_for_each(RandomIt first, RandomIt last, Function f, Partitioner partitioner = Partitioner())
+{
+    parallel_for_each(default_pool(), first, last, std::move(f), partitioner);
+}
+
+template<typename RandomIt, typename OutputRandomIt, typename UnaryOperation, typename Partitioner = auto_partitioner>
+OutputRandomIt parallel_transform(thread_pool& pool, RandomIt first, RandomIt last, OutputRandomIt d_first, UnaryOperation op,
+    Partitioner partitioner = Partitioner())
+{
+    std::size_t const length = static_cast<std::size_t>(last - first);
+    run_blocks(pool, length, partitioner, [first, d_first, &op](std::size_t begin, std::size_t end)
+    {
+        std::transform(first + begin, first + end, d_first + begin, op);
+    });
+    return d_first + length;
+}
+template<typename RandomIt, typename OutputRandomIt, typename UnaryOperation, typename Partitioner = auto_partitioner>
+OutputRandomIt parallel_transform(RandomIt first, RandomIt last, OutputRandomIt d_first, UnaryOperation op,
+    Partitioner partitioner = Partitioner())
+{
+    return parallel_transform(default_pool(), first, last, d_first, std::move(op), partitioner);
+}
+
+// reduce(init, transform(x)...). Partial results are combined in block order, so only associativity is required
+template<typename RandomIt, typename T, typename BinaryReduceOp, typename UnaryTransformOp, typename Partitioner = auto_partitioner>
+T parallel_transform_reduce(thread_pool& pool, RandomIt first, RandomIt last, T init, BinaryReduceOp reduce, UnaryTransformOp transform,
+    Partitioner partitioner = Partitioner())
+{
+    std::size_t const length = static_cast<std::size_t>(last - first);
+    if (length == 0)
+    {
+        return init;
+    }
+    auto const partials = run_blocks(pool, length, partitioner, [first, &reduce, &transform](std::size_t begin, std::size_t end)
+    {
+        T partial = transform(first[begin]); // No identity element is needed: every block has at least one element
+        for (std::size_t i = begin + 1; i < end; i++)
+        {
+            partial = reduce(std::move(partial), transform(first[i]));
+        }
+        return partial;
+    });
+    for (auto const& partial : partials)
+    {
+        init = reduce(std::move(init), partial);
+    }
+    return init;
+}
+template<typename RandomIt, typename T, typename BinaryReduceOp, typename UnaryTransformOp, typename Partitioner = auto_partitioner>
+T parallel_transform_reduce(RandomIt first, RandomIt last, T init, BinaryReduceOp reduce, UnaryTransformOp transform,
+    Partitioner partitioner = Partitioner())
+{
+    return parallel_transform_reduce(default_pool(), first, last, std::move(init), std::move(reduce), std::move(transform), partitioner);
+}
+
+template<typename RandomIt, typename Compare>
+RandomIt median_of_three(RandomIt a, RandomIt b, RandomIt c, Compare const& comp)
+{
+    if (comp(*a, *b))
+    {
+        return comp(*b, *c) ? b : comp(*a, *c) ? c : a;
+    }
+    return comp(*a, *c) ? a : comp(*b, *c) ? c : b;
+}
+
+// Every partition step spawns the smaller part as a pool task (from a worker it goes to the worker's deque, where
+// idle workers steal it) and goes on with the larger part, so a task has at most half the elements of its parent.
+// Parts of at most cutoff elements, and parts still left after depth_left steps (bad pivots), go to std::sort
+template<typename RandomIt, typename Compare>
+void quick_sort_part(thread_pool& pool, RandomIt first, RandomIt last, Compare const& comp, std::size_t cutoff, unsigned depth_left)
+{
+    std::vector<std::future<void>> parts;
+    auto const finish = [&]
+    {
+        for (auto& f : parts)
+        {
+            wait_running_tasks(pool, f); // No get() yet, every part must be done before the range can go away
+        }
+    };
+    try
+    {
+        for (; static_cast<std::size_t>(last - first) > cutoff && depth_left != 0; --depth_left)
+        {
+            auto const pivot = *median_of_three(first, first + (last - first) / 2, last - 1, comp); // Copied, partition moves elements
+            RandomIt const lower_end = std::partition(first, last, [&](auto const& x) { return comp(x, pivot); });
+            RandomIt const upper_begin = std::partition(lower_end, last, [&](auto const& x) { return !comp(pivot, x); }); // Equal to the pivot: in place
+            auto const spawn = [&](RandomIt part_first, RandomIt part_last)
+            {
+                parts.push_back(pool.submit([&pool, part_first, part_last, &comp, cutoff, depth_left]
+                {
+                    quick_sort_part(pool, part_first, part_last, comp, cutoff, depth_left - 1);
+                }));
+            };
+            if (lower_end - first < last - upper_begin)
+            {
+                spawn(first, lower_end);
+                first = upper_begin;
+            }
+            else
+            {
+                spawn(upper_begin, last);
+                last = lower_end;
+            }
+        }
+        std::sort(first, last, comp);
+    }
+    catch (...)
+    {
+        finish();
+        throw;
+    }
+    finish();
+    for (auto& f : parts)
+    {
+        f.get();
+    }
+}
+
+// Not stable. Needs copyable elements (the pivot is copied)
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_sort(thread_pool& pool, RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t cutoff = 4096)
+{
+    unsigned depth_limit = 0; // 2 log2(n) like introsort: with reasonable pivots the parts are small long before
+    for (auto n = last - first; n > 1; n /= 2)
+    {
+        depth_limit += 2;
+    }
+    quick_sort_part(pool, first, last, comp, std::max<std::size_t>(cutoff, 1), depth_limit);
+}
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_sort(RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t cutoff = 4096)
+{
+    parallel_sort(default_pool(), first, last, std::move(comp), cutoff);
+}
+
+// Moves the merge of two sorted ranges to out, elements of the first range before equal ones of the second.
+// The larger range is split in the middle and the other one at the same value (binary search), which gives two
+// independent merges: the upper one is spawned. cutoff must be at least 2, otherwise a split can leave a range whole
+template<typename InputIt, typename OutputIt, typename Compare>
+void parallel_merge(thread_pool& pool, InputIt first1, InputIt last1, InputIt first2, InputIt last2, OutputIt out,
+    Compare const& comp, std::size_t cutoff)
+{
+    std::size_t const n1 = static_cast<std::size_t>(last1 - first1);
+    std::size_t const n2 = static_cast<std::size_t>(last2 - first2);
+    if (n1 + n2 <= cutoff)
+    {
+        std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+            std::make_move_iterator(first2), std::make_move_iterator(last2), out, comp);
+        return;
+    }
+    InputIt split1, split2;
+    if (n1 >= n2)
+    {
+        split1 = first1 + n1 / 2;
+        split2 = std::lower_bound(first2, last2, *split1, comp); // Equal elements of the second range go after
+    }
+    else
+    {
+        split2 = first2 + n2 / 2;
+        split1 = std::upper_bound(first1, last1, *split2, comp); // Equal elements of the first range go before
+    }
+    OutputIt const out_upper = out + (split1 - first1) + (split2 - first2);
+    std::future<void> upper = pool.submit([&pool, split1, last1, split2, last2, out_upper, &comp, cutoff]
+    {
+        parallel_merge(pool, split1, last1, split2, last2, out_upper, comp, cutoff);
+    });
+    try
+    {
+        parallel_merge(pool, first1, split1, first2, split2, out, comp, cutoff);
+    }
+    catch (...)
+    {
+        wait_running_tasks(pool, upper);
+        throw;
+    }
+    wait_running_tasks(pool, upper);
+    upper.get();
+}
+
+// Sorts the n elements at a and leaves them at b if into_b, else at a. The halves are sorted into the other
+// array, then merged back, so no level copies anything. The lower half is spawned
+template<typename It1, typename It2, typename Compare>
+void merge_sort_part(thread_pool& pool, It1 a, It2 b, std::size_t n, bool into_b, Compare const& comp, std::size_t cutoff)
+{
+    if (n <= cutoff)
+    {
+        std::stable_sort(a, a + n, comp);
+        if (into_b)
+        {
+            std::move(a, a + n, b);
+        }
+        return;
+    }
+    std::size_t const half = n / 2;
+    std::future<void> lower = pool.submit([&pool, a, b, half, into_b, &comp, cutoff]
+    {
+        merge_sort_part(pool, a, b, half, !into_b, comp, cutoff);
+    });
+    try
+    {
+        merge_sort_part(pool, a + half, b + half, n - half, !into_b, comp, cutoff);
+    }
+    catch (...)
+    {
+        wait_running_tasks(pool, lower);
+        throw;
+    }
+    wait_running_tasks(pool, lower);
+    lower.get();
+    if (into_b)
+    {
+        parallel_merge(pool, a, a + half, a + half, a + n, b, comp, cutoff);
+    }
+    else
+    {
+        parallel_merge(pool, b, b + half, b + half, b + n, a, comp, cutoff);
+    }
+}
+
+// Stable. Uses a buffer of n elements. If comp throws, the range is left with valid but unspecified elements
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_stable_sort(thread_pool& pool, RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t cutoff = 4096)
+{
+    std::size_t const n = static_cast<std::size_t>(last - first);
+    if (n <= cutoff)
+    {
+        std::stable_sort(first, last, comp);
+        return;
+    }
+    // The elements are moved to the buffer and sorted back into the range
+    std::vector<typename std::iterator_traits<RandomIt>::value_type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+    merge_sort_part(pool, buffer.begin(), first, n, true, comp, std::max<std::size_t>(cutoff, 2));
+}
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_stable_sort(RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t cutoff = 4096)
+{
+    parallel_stable_sort(default_pool(), first, last, std::move(comp), cutoff);
+}
+
+
+
+
+
+
+/********************************************************/
+/* 11.2.6 Testing the performance of multithreaded code */
+/********************************************************/
+
+// Launch/join cost of every wrapper in this file compared to raw std::thread.
+// Output is one JSON object per line, so results of two versions can be diffed or plotted
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_stats
+{
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+};
+bench_stats summarize(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    auto const at = [&samples](double q) { return samples[static_cast<std::size_t>(q * (samples.size() - 1))]; };
+    return { std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size(), at(0.5), at(0.99), at(0.999) };
+}
+void print_result(char const* benchmark, char const* variant, std::size_t param, std::size_t iterations, bench_stats const& s)
+{
+    std::printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"param\":%zu,\"iterations\":%zu,"
+        "\"mean_ns\":%.0f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f}\n",
+        benchmark, variant, param, iterations, s.mean_ns, s.p50_ns, s.p99_ns, s.p999_ns);
+}
+double elapsed_ns(bench_clock::time_point from, bench_clock::time_point to)
+{
+    return std::chrono::duration<double, std::nano>(to - from).count();
+}
+
+// launch(body) starts body on a new thread through one wrapper and returns after the wrapper has joined it.
+// Spawn latency: from the start of the launch until body runs. Join latency: from the end of body until launch returns
+template<typename Launch>
+void bench_spawn_join(char const* variant, Launch launch, std::size_t iterations)
+{
+    std::vector<double> spawn, join;
+    for (std::size_t i = 0; i < iterations; i++)
+    {
+        bench_clock::time_point started, finished;
+        auto const body = [&started, &finished]
+        {
+            started = bench_clock::now();
+            finished = bench_clock::now();
+        };
+        auto const before = bench_clock::now();
+        launch(body);
+        auto const after = bench_clock::now(); // The join makes started and finished visible here
+        spawn.push_back(elapsed_ns(before, started));
+        join.push_back(elapsed_ns(finished, after));
+    }
+    print_result("spawn_latency", variant, 0, iterations, summarize(spawn));
+    print_result("join_latency", variant, 0, iterations, summarize(join));
+}
+
+struct payload_receiver
+{
+    std::size_t received = 0;
+    void do_lengthy_work(std::vector<char> const& arg) { received += arg.size(); }
+};
+void take_copy(std::vector<char> const& arg) { (void)arg; }
+void take_ref(std::vector<char>& arg) { (void)arg; }
+void take_moved(std::vector<char> arg) { (void)arg; }
+
+// Argument passing styles of 2.2 for a payload of the given size. Includes the launch and the join
+void bench_argument_transfer(std::size_t payload_size, std::size_t iterations)
+{
+    std::vector<char> payload(payload_size, 'x');
+    payload_receiver receiver;
+    std::vector<double> copy, ref, move, member;
+    for (std::size_t i = 0; i < iterations; i++)
+    {
+        auto start = bench_clock::now();
+        std::thread(take_copy, payload).join(); // Copied into the thread's storage
+        copy.push_back(elapsed_ns(start, bench_clock::now()));
+
+        start = bench_clock::now();
+        std::thread(take_ref, std::ref(payload)).join(); // Only the reference is copied
+        ref.push_back(elapsed_ns(start, bench_clock::now()));
+
+        std::vector<char> to_move(payload); // Not measured
+        start = bench_clock::now();
+        std::thread(take_moved, std::move(to_move)).join(); // Ownership is transferred
+        move.push_back(elapsed_ns(start, bench_clock::now()));
+
+        start = bench_clock::now();
+        std::thread(&payload_receiver::do_lengthy_work, &receiver, payload).join(); // Member function, copied argument
+        member.push_back(elapsed_ns(start, bench_clock::now()));
+    }
+    print_result("argument_transfer", "copy", payload_size, iterations, summarize(copy));
+    print_result("argument_transfer", "std_ref", payload_size, iterations, summarize(ref));
+    print_result("argument_transfer", "move", payload_size, iterations, summarize(move));
+    print_result("argument_transfer", "member_function", payload_size, iterations, summarize(member));
+}
+
+// launchers threads, each launching and joining threads as fast as it can. Every launch and join is timed:
+// the launch_latency percentiles show how much the launchers slow each other down, launch_throughput is
+// the launches per second of all launchers together
+void bench_launch_throughput(unsigned launchers, std::size_t launches_per_launcher)
+{
+    std::vector<std::vector<double>> samples(launchers); // One per launcher, merged after the join
+    auto const start = bench_clock::now();
+    {
+        thread_group group(launchers);
+        for (unsigned i = 0; i < launchers; i++)
+        {
+            group.spawn([&samples = samples[i], launches_per_launcher]
+            {
+                samples.reserve(launches_per_launcher);
+                for (std::size_t j = 0; j < launches_per_launcher; j++)
+                {
+                    auto const launched = bench_clock::now();
+                    {
+                        joining_thread t([] {});
+                    }
+                    samples.push_back(elapsed_ns(launched, bench_clock::now()));
+                }
+            });
+        }
+    }
+    double const total_ns = elapsed_ns(start, bench_clock::now());
+    std::size_t const launches = launchers * launches_per_launcher;
+    std::vector<double> all;
+    for (auto const& s : samples)
+    {
+        all.insert(all.end(), s.begin(), s.end());
+    }
+    print_result("launch_latency", "joining_thread", launchers, launches, summarize(std::move(all)));
+    std::printf("{\"benchmark\":\"launch_throughput\",\"variant\":\"joining_thread\",\"param\":%u,\"iterations\":%zu,"
+        "\"launches_per_s\":%.0f}\n", launchers, launches, launches / total_ns * 1e9);
+}
+
+// threads threads each add into their own slot of a packed std::vector and of per_thread_slots.
+// Reported as ns per update: the packed vector gets slower as threads are added, the padded slots don't
+template<typename Slots>
+double time_slot_updates(Slots& slots, unsigned threads, std::size_t updates_per_thread)
+{
+    auto const start = bench_clock::now();
+    {
+        thread_group group(threads);
+        for (unsigned i = 0; i < threads; i++)
+        {
+            group.spawn([&slots, i, updates_per_thread]
+            {
+                std::uint64_t volatile& slot = slots[i]; // Every iteration stores to the slot, like a hot shared counter
+                for (std::size_t j = 0; j < updates_per_thread; j++)
+                {
+                    slot = slot + 1;
+                }
+            });
+        }
+    }
+    return elapsed_ns(start, bench_clock::now()) / updates_per_thread;
+}
+// One sample per round, the two layouts alternate so both see the same machine state
+void bench_reduction_slots(unsigned threads, std::size_t updates_per_thread, std::size_t rounds)
+{
+    std::vector<std::uint64_t> packed(threads);
+    per_thread_slots<std::uint64_t> padded(threads);
+    std::vector<double> packed_ns, padded_ns;
+    for (std::size_t r = 0; r < rounds; r++)
+    {
+        packed_ns.push_back(time_slot_updates(packed, threads, updates_per_thread));
+        padded_ns.push_back(time_slot_updates(padded, threads, updates_per_thread));
+    }
+    print_result("reduction_slots", "packed_vector", threads, rounds * threads * updates_per_thread, summarize(std::move(packed_ns)));
+    print_result("reduction_slots", "per_thread_slots", threads, rounds * threads * updates_per_thread, summarize(std::move(padded_ns)));
+}
+
+// Submits tasks empty tasks to the pool one by one (post) and with one submit_bulk, and waits for them.
+// Reported as ns per task, submission and completion included
+void bench_bulk_submit(thread_pool& pool, std::size_t tasks, std::size_t rounds)
+{
+    std::vector<double> single, bulk;
+    std::vector<std::size_t> items(tasks);
+    for (std::size_t r = 0; r < rounds; r++)
+    {
+        std::atomic<std::size_t> remaining{ tasks };
+        auto start = bench_clock::now();
+        for (std::size_t i = 0; i < tasks; i++)
+        {
+            pool.post([&remaining] { remaining.fetch_sub(1, std::memory_order_release); });
+        }
+        while (remaining.load(std::memory_order_acquire) != 0)
+        {
+            pool.run_pending_task();
+        }
+        single.push_back(elapsed_ns(start, bench_clock::now()) / tasks);
+
+        start = bench_clock::now();
+        std::future<void> done = pool.submit_bulk(items.begin(), items.end(), [](std::size_t) {});
+        while (done.wait_for(std::chrono::seconds(0)) == std::future_status::timeout)
+        {
+            pool.run_pending_task();
+        }
+        bulk.push_back(elapsed_ns(start, bench_clock::now()) / tasks);
+    }
+    print_result("bulk_submit", "post_per_task", tasks, rounds * tasks, summarize(single));
+    print_result("bulk_submit", "submit_bulk", tasks, rounds * tasks, summarize(bulk));
+}
+
+void benchmark_thread_wrappers(std::size_t iterations = 1000)
+{
+    bench_spawn_join("std_thread", [](auto body)
+    {
+        std::thread t(body);
+        t.join();
+    }, iterations);
+    bench_spawn_join("thread_guard", [](auto body)
+    {
+        std::thread t(body);
+        thread_guard g(t);
+    }, iterations);
+    bench_spawn_join("scoped_thread", [](auto body)
+    {
+        scoped_thread t{ std::thread(body) };
+    }, iterations);
+    bench_spawn_join("joining_thread", [](auto body)
+    {
+        joining_thread t(body);
+    }, iterations);
+    bench_spawn_join("joining_thread_stop_token", [](auto body)
+    {
+        joining_thread t([body](std::stop_token) { body(); }); // Pays for the stop state
+    }, iterations);
+    for (std::size_t payload_size : { std::size_t(8), std::size_t(1) << 10, std::size_t(64) << 10, std::size_t(1) << 20 })
+    {
+        bench_argument_transfer(payload_size, iterations / 10 + 1);
+    }
+    unsigned const hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned launchers = 1;; launchers = std::min(2 * launchers, hardware_threads)) // Ends at hardware_threads, e.g. 1 2 4 6
+    {
+        bench_launch_throughput(launchers, iterations);
+        bench_reduction_slots(launchers, iterations * 1000, 10);
+        if (launchers == hardware_threads)
+        {
+            break;
+        }
+    }
+    thread_pool pool;
+    for (std::size_t tasks : { std::size_t(20), std::size_t(1000), std::size_t(100000) })
+    {
+        bench_bulk_submit(pool, tasks, iterations / 100 + 1);
+    }
+}
+
+// Sorts of n random 32-bit values, ns per sort. Every variant sorts the same data
+template<typename Sort>
+void bench_sort(char const* variant, std::size_t n, std::size_t iterations, Sort sort)
+{
+    std::vector<std::uint32_t> data(n);
+    std::vector<double> samples;
+    for (std::size_t i = 0; i < iterations; i++)
+    {
+        std::mt19937 gen(static_cast<std::uint32_t>(i)); // Not measured
+        std::generate(data.begin(), data.end(), std::ref(gen));
+        auto const start = bench_clock::now();
+        sort(data.begin(), data.end());
+        samples.push_back(elapsed_ns(start, bench_clock::now()));
+    }
+    print_result("sort", variant, n, iterations, summarize(samples));
+}
+// From 1e3 to max_elements elements. At 1e9 the stable sorts need 8 GB (data and buffer)
+void benchmark_parallel_sort(std::size_t max_elements = 1000000000)
+{
+    thread_pool& pool = default_pool();
+    for (std::size_t n = 1000; n <= max_elements; n *= 10)
+    {
+        std::size_t const iterations = std::max<std::size_t>(10000000 / n, 1);
+        bench_sort("std_sort", n, iterations, [](auto first, auto last) { std::sort(first, last); });
+        bench_sort("parallel_sort", n, iterations, [&pool](auto first, auto last) { parallel_sort(pool, first, last); });
+        bench_sort("std_stable_sort", n, iterations, [](auto first, auto last) { std::stable_sort(first, last); });
+        bench_sort("parallel_stable_sort", n, iterations, [&pool](auto first, auto last) { parallel_stable_sort(pool, first, last); });
+    }
+}
+
+// Brute-force testing (11.2.4) of the wrappers and the pool under load. Every driver thread runs a random sequence
+// of operations from its own seed, so a failing step can be found again with the same seed: only the interleaving
+// of the threads changes from run to run. The operations check the hazards documented in this file:
+//     a wrapper is destroyed only after its thread has finished (func and some_local_state in 2.1.1)
+//     a std::string converted from a buffer before launch doesn't depend on the buffer (the fix of oops in 2.2)
+//     assigning to a joining_thread joins the thread it owned, a moved-from one has nothing to join
+//     joining a joined thread throws instead of doing anything (the join loop of Listing 2.8)
+//     pool tasks run once and their results arrive
+//     workers retiring after idle_timeout give their slots to the ones prewarm() starts meanwhile
+// The state threads write is a plain int, read after the join: build with -fsanitize=thread and a missing join
+// is reported as a data race even when the timing hides it
+struct stress_target
+{
+    int runs = 0;
+    auto body()
+    {
+        return [this] { ++runs; };
+    }
+};
+
+enum class stress_op : unsigned
+{
+    thread_guard_scope,
+    scoped_thread_scope,
+    joining_thread_scope,
+    joining_thread_assign,
+    joining_thread_move_join,
+    joining_thread_stop,
+    converted_string_argument,
+    thread_group_scope,
+    pool_submit,
+    pool_bulk,
+    pool_retire_prewarm,
+    count
+};
+char const* const stress_op_names[] = { "thread_guard_scope", "scoped_thread_scope", "joining_thread_scope", "joining_thread_assign",
+    "joining_thread_move_join", "joining_thread_stop", "converted_string_argument", "thread_group_scope", "pool_submit", "pool_bulk",
+    "pool_retire_prewarm" };
+
+// Keeps the first failure, the others are only counted
+class stress_failures
+{
+    std::mutex m;
+    std::string first; // Guarded by m
+    std::atomic<std::size_t> failures{ 0 };
+public:
+    void report(std::string const& what, std::uint32_t seed, unsigned thread, std::size_t step)
+    {
+        if (failures.fetch_add(1, std::memory_order_relaxed) == 0)
+        {
+            std::ostringstream message;
+            message << "seed " << seed << ", thread " << thread << ", step " << step << ": " << what;
+            std::lock_guard<std::mutex> lk(m);
+            first = message.str();
+        }
+    }
+    std::size_t count() const noexcept
+    {
+        return failures.load(std::memory_order_relaxed);
+    }
+    std::string first_failure()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return first;
+    }
+};
+
+// expect(ok, what) records a failure. Only gen decides what an operation does
+template<typename Expect>
+void run_stress_op(stress_op op, thread_pool& pool, std::mt19937& gen, Expect expect)
+{
+    switch (op)
+    {
+    case stress_op::thread_guard_scope:
+    {
+        stress_target s;
+        {
+            std::thread t(s.body());
+            thread_guard g(t);
+        }
+        expect(s.runs == 1, "thread_guard destroyed before its thread finished");
+        break;
+    }
+    case stress_op::scoped_thread_scope:
+    {
+        stress_target s;
+        {
+            scoped_thread t{ std::thread(s.body()) };
+        }
+        expect(s.runs == 1, "scoped_thread destroyed before its thread finished");
+        break;
+    }
+    case stress_op::joining_thread_scope:
+    {
+        stress_target s;
+        {
+            joining_thread t(s.body());
+        }
+        expect(s.runs == 1, "joining_thread destroyed before its thread finished");
+        break;
+    }
+    case stress_op::joining_thread_assign:
+    {
+        stress_target a, b;
+        {
+            joining_thread t(a.body());
+            t = joining_thread(b.body());
+            expect(a.runs == 1, "joining_thread assignment didn't join the old thread");
+        }
+        expect(b.runs == 1, "joining_thread destroyed before its thread finished");
+        break;
+    }
+    case stress_op::joining_thread_move_join:
+    {
+        stress_target a, b;
+        joining_thread t1(a.body());
+        joining_thread t2(std::move(t1));
+        joining_thread t3(b.body());
+        if (gen() % 2 == 0)
+        {
+            t2.swap(t3);
+        }
+        expect(!t1.joinable(), "moved-from joining_thread still joinable");
+        t2.join();
+        t3.join();
+        expect(a.runs == 1 && b.runs == 1, "joining_thread join returned before its thread finished");
+        bool threw = false;
+        try
+        {
+            t2.join();
+        }
+        catch (std::system_error const&)
+        {
+            threw = true;
+        }
+        expect(threw, "second join of a joining_thread didn't throw");
+        break;
+    }
+    case stress_op::joining_thread_stop:
+    {
+        std::atomic<bool> started{ false };
+        joining_thread t([&started](std::stop_token stop)
+        {
+            started.store(true, std::memory_order_relaxed);
+            while (!stop.stop_requested())
+            {
+                std::this_thread::yield();
+            }
+        });
+        if (gen() % 2 == 0)
+        {
+            while (!started.load(std::memory_order_relaxed))
+            {
+                std::this_thread::yield();
+            }
+        }
+        break; // The destructor requests the stop: the test hangs here if it doesn't
+    }
+    case stress_op::converted_string_argument:
+    {
+        // Passing buffer itself would convert it in the new thread, after oops may have returned: the wrappers
+        // forward to std::thread and don't change that, so only the explicit conversion of 2.2 is checked
+        unsigned const value = static_cast<unsigned>(gen());
+        char buffer[16];
+        std::snprintf(buffer, sizeof(buffer), "%u", value);
+        std::atomic<bool> overwritten{ false };
+        bool matched = false;
+        {
+            joining_thread t([&matched, &overwritten, value](std::string const& s)
+            {
+                while (!overwritten.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+                matched = s == std::to_string(value);
+            }, std::string(buffer));
+            std::memset(buffer, 'x', sizeof(buffer) - 1); // Like oops returning: the buffer is gone
+            overwritten.store(true, std::memory_order_release);
+        }
+        expect(matched, "converted argument changed with the buffer");
+        break;
+    }
+    case stress_op::thread_group_scope:
+    {
+        std::vector<stress_target> targets(1 + gen() % 8);
+        {
+            thread_group group(targets.size());
+            for (auto& s : targets)
+            {
+                group.spawn(s.body());
+            }
+            if (gen() % 2 == 0)
+            {
+                group.join_all();
+            }
+        }
+        expect(std::all_of(targets.begin(), targets.end(), [](stress_target const& s) { return s.runs == 1; }),
+            "thread_group destroyed before its threads finished");
+        break;
+    }
+    case stress_op::pool_submit:
+    {
+        unsigned const value = static_cast<unsigned>(gen());
+        expect(pool.submit([value] { return value / 2; }).get() == value / 2, "wrong result from thread_pool::submit");
+        break;
+    }
+    case stress_op::pool_bulk:
+    {
+        std::vector<int> items(1 + gen() % 64);
+        pool.submit_bulk(items.begin(), items.end(), [](int& x) { ++x; }).get();
+        expect(std::all_of(items.begin(), items.end(), [](int x) { return x == 1; }), "submit_bulk didn't run every item once");
+        break;
+    }
+    case stress_op::pool_retire_prewarm:
+    {
+        thread_pool_options options;
+        options.thread_count = 2;
+        options.lazy = true;
+        options.idle_timeout = std::chrono::milliseconds(1);
+        thread_pool shrinking(options);
+        for (unsigned i = 0; i < 4; i++)
+        {
+            expect(shrinking.prewarm(2, 4096) <= 2, "prewarm started more workers than slots");
+            std::this_thread::sleep_for(std::chrono::microseconds(500 + gen() % 1000)); // Around the timeout
+        }
+        unsigned const value = static_cast<unsigned>(gen());
+        expect(shrinking.submit([value] { return value / 2; }).get() == value / 2, "wrong result from a shrinking pool");
+        break;
+    }
+    case stress_op::count:
+        break;
+    }
+}
+
+// Runs with 1, 2, 4... up to max_threads driver threads (0: twice the hardware threads, so the cores are
+// oversubscribed). Latencies of every operation are printed per thread count. Returns false if a check failed,
+// and prints the first failure with the seed and step to replay
+bool stress_thread_wrappers(std::uint32_t seed = 1, std::size_t ops_per_thread = 2000, unsigned max_threads = 0)
+{
+    unsigned const hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (max_threads == 0)
+    {
+        max_threads = 2 * hardware_threads;
+    }
+    constexpr unsigned op_count = static_cast<unsigned>(stress_op::count);
+    stress_failures failures;
+    thread_pool pool(hardware_threads);
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        std::vector<std::vector<double>> latencies(threads * op_count); // [thread * op_count + op]
+        {
+            thread_group group(threads);
+            for (unsigned i = 0; i < threads; i++)
+            {
+                group.spawn([&, i]
+                {
+                    std::mt19937 gen(seed ^ (i * 0x9e3779b9u));
+                    for (std::size_t step = 0; step < ops_per_thread; step++)
+                    {
+                        unsigned const op = static_cast<unsigned>(gen() % op_count);
+                        auto const expect = [&](bool ok, char const* what)
+                        {
+                            if (!ok)
+                            {
+                                failures.report(std::string(stress_op_names[op]) + ": " + what, seed, i, step);
+                            }
+                        };
+                        auto const start = bench_clock::now();
+                        try
+                        {
+                            run_stress_op(static_cast<stress_op>(op), pool, gen, expect);
+                        }
+                        catch (std::exception const& e) // E.g. std::system_error when no more threads can be started
+                        {
+                            expect(false, e.what());
+                        }
+                        latencies[i * op_count + op].push_back(elapsed_ns(start, bench_clock::now()));
+                    }
+                });
+            }
+        }
+        for (unsigned op = 0; op < op_count; op++)
+        {
+            std::vector<double> all;
+            for (unsigned i = 0; i < threads; i++)
+            {
+                all.insert(all.end(), latencies[i * op_count + op].begin(), latencies[i * op_count + op].end());
+            }
+            std::size_t const count = all.size();
+            if (count != 0)
+            {
+                print_result("stress", stress_op_names[op], threads, count, summarize(std::move(all)));
+            }
+        }
+    }
+    if (failures.count() != 0)
+    {
+        std::fprintf(stderr, "stress: %zu failures, first: %s\n", failures.count(), failures.first_failure().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Two tasks that block until released are submitted back to back to an executor whose only worker is asleep.
+// The sleeper takes one, the other needs a new worker: both must start while neither has finished
+bool check_executor_starts_blocked_tasks(unsigned rounds = 200)
+{
+    for (unsigned round = 0; round < rounds; round++)
+    {
+        std::atomic<unsigned> started{ 0 };
+        std::promise<void> release;
+        std::shared_future<void> const released = release.get_future().share();
+        bool both_started = false;
+        {
+            background_executor executor(4, 16, overflow_policy::reject);
+            executor.submit([] {});
+            std::this_thread::sleep_for(std::chrono::milliseconds(1)); // Let the worker go to sleep
+            auto const blocking = [&started, released]
+            {
+                started.fetch_add(1, std::memory_order_relaxed);
+                released.wait();
+            };
+            executor.submit(blocking);
+            executor.submit(blocking);
+            auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (!(both_started = started.load(std::memory_order_relaxed) == 2) && std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::yield();
+            }
+            release.set_value();
+        } // Joins the workers
+        if (!both_started)
+        {
+            std::fprintf(stderr, "background_executor: round %u, the second blocking task didn't start\n", round);
+            return false;
+        }
+    }
+    return true;
+}